@@ -0,0 +1,562 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cf.h"
+
+/*
+ * Overlay file: a header sector, the sector bitmap padded to whole
+ * sectors, then a slot for every sector of the base image at its own
+ * offset. Only slots of sectors the guest wrote are ever touched, so
+ * the file stays sparse.
+ */
+#define OVL_MAGIC "P80OVL1\n"
+
+/*
+ * Compressed image: a 32-byte header (magic, chunk size, chunk count,
+ * image size), an index of 16-byte entries (offset, length, capacity)
+ * and independently deflated 64 KB chunks. Length 0 is an all-zero
+ * chunk, length CHUNK a stored one. Chunks are inflated on demand into
+ * a small LRU cache; a rewritten chunk goes back in place if it still
+ * fits its capacity and is appended otherwise.
+ */
+#define Z_MAGIC "P80CFZ1\n"
+#define CHUNK   65536
+#define NCACHE  64	/* 4 MB */
+
+typedef struct Slot Slot;
+struct Slot{
+	uint32_t chunk;
+	uint32_t used;	/* LRU stamp, 0 when empty */
+	int dirty;
+	uint8_t data[CHUNK];
+};
+
+struct CF{
+	char *path;
+	uint8_t *base;
+	uint32_t nsect;
+	int zfd;
+	uint32_t nchunk;
+	uint8_t *index;
+	int16_t *cached;
+	Slot *slot;
+	uint32_t clock;
+	off_t zend;
+	uint8_t *zbuf;
+	int ofd;
+	uint8_t *ovl;
+	size_t olen;
+	uint8_t *bitmap;
+	size_t blen;
+	uint8_t *odata;
+};
+
+static uint32_t
+get32(uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint64_t
+get64(uint8_t *p)
+{
+	return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static void
+put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+/* deflate one chunk into buf; returns what to store and sets *len */
+static uint8_t *
+zpack(uint8_t *data, uint8_t *buf, uLongf *len)
+{
+	int i;
+
+	for(i = 0; i < CHUNK && data[i] == 0; i++)
+		;
+	if(i == CHUNK){
+		*len = 0;
+		return data;
+	}
+	*len = compressBound(CHUNK);
+	if(compress2(buf, len, data, CHUNK, Z_DEFAULT_COMPRESSION) != Z_OK || *len >= CHUNK){
+		*len = CHUNK;
+		return data;
+	}
+	return buf;
+}
+
+/* an index entry pointing outside the file or past zbuf */
+static int
+zbad(CF *cf, uint8_t *e)
+{
+	uint32_t len;
+
+	len = get32(e + 8);
+	return len > compressBound(CHUNK) || get64(e) > (uint64_t)cf->zend ||
+		len > (uint64_t)cf->zend - get64(e);
+}
+
+static int
+zread(CF *cf, uint32_t c, uint8_t *data)
+{
+	uint8_t *e;
+	uint32_t len;
+	uLongf n;
+
+	e = cf->index + (size_t)c * 16;
+	if(zbad(cf, e)){
+		errno = EIO;
+		return -1;
+	}
+	len = get32(e + 8);
+	if(len == 0){
+		memset(data, 0, CHUNK);
+		return 0;
+	}
+	if(pread(cf->zfd, len == CHUNK ? data : cf->zbuf, len, get64(e)) != (ssize_t)len)
+		return -1;
+	if(len == CHUNK)
+		return 0;
+	n = CHUNK;
+	if(uncompress(data, &n, cf->zbuf, len) != Z_OK || n != CHUNK){
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+zwrite(CF *cf, Slot *s)
+{
+	uint8_t *e, *p;
+	uLongf len;
+	uint64_t off;
+
+	e = cf->index + (size_t)s->chunk * 16;
+	p = zpack(s->data, cf->zbuf, &len);
+	off = get64(e);
+	if(len > get32(e + 12)){
+		off = cf->zend;
+		cf->zend += len;
+		put32(e + 12, len);
+	}
+	put64(e, off);
+	put32(e + 8, len);
+	if(len > 0 && pwrite(cf->zfd, p, len, off) != (ssize_t)len)
+		return -1;
+	if(pwrite(cf->zfd, e, 16, 32 + (off_t)s->chunk * 16) != 16)
+		return -1;
+	s->dirty = 0;
+	return 0;
+}
+
+static int
+zsync(CF *cf)
+{
+	int i;
+
+	for(i = 0; i < NCACHE; i++)
+		if(cf->slot[i].dirty && zwrite(cf, &cf->slot[i]) < 0)
+			return -1;
+	return 0;
+}
+
+static uint8_t *
+zsector(CF *cf, uint32_t lba, int write)
+{
+	Slot *s;
+	uint32_t c;
+	int i, v;
+
+	c = lba / (CHUNK / 512);
+	i = cf->cached[c];
+	if(i < 0){
+		for(i = 0, v = 0; i < NCACHE; i++)
+			if(cf->slot[i].used < cf->slot[v].used)
+				v = i;
+		s = &cf->slot[v];
+		if(s->dirty && zwrite(cf, s) < 0)
+			return NULL;
+		if(s->used)
+			cf->cached[s->chunk] = -1;
+		s->used = 0;
+		if(zread(cf, c, s->data) < 0)
+			return NULL;
+		s->chunk = c;
+		cf->cached[c] = i = v;
+	}
+	s = &cf->slot[i];
+	s->used = ++cf->clock;
+	if(write)
+		s->dirty = 1;
+	return s->data + (lba % (CHUNK / 512)) * 512;
+}
+
+static int
+zopen(CF *cf, int fd)
+{
+	uint8_t hdr[32];
+	size_t len;
+	uint32_t c;
+
+	if(pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || get32(hdr + 8) != CHUNK){
+		errno = EINVAL;
+		return -1;
+	}
+	cf->zfd = fd;
+	cf->nchunk = get32(hdr + 12);
+	cf->nsect = get64(hdr + 16) / 512;
+	if(cf->nsect > (uint64_t)cf->nchunk * (CHUNK / 512)){
+		errno = EINVAL;
+		return -1;
+	}
+	len = (size_t)cf->nchunk * 16;
+	cf->index = malloc(len);
+	cf->cached = malloc(cf->nchunk * sizeof(cf->cached[0]));
+	cf->slot = calloc(NCACHE, sizeof(Slot));
+	cf->zbuf = malloc(compressBound(CHUNK));
+	if(cf->index == NULL || cf->cached == NULL || cf->slot == NULL || cf->zbuf == NULL)
+		return -1;
+	if(pread(fd, cf->index, len, 32) != (ssize_t)len){
+		errno = EINVAL;
+		return -1;
+	}
+	cf->zend = lseek(fd, 0, SEEK_END);
+	if(cf->zend < 0)
+		return -1;
+	for(c = 0; c < cf->nchunk; c++){
+		if(zbad(cf, cf->index + (size_t)c * 16)){
+			errno = EINVAL;
+			return -1;
+		}
+		cf->cached[c] = -1;
+	}
+	return 0;
+}
+
+/* pack a raw image into the compressed format */
+int
+cf_compress(char *in, char *out)
+{
+	uint8_t hdr[32], *index, *data, *buf, *p;
+	uint32_t nchunk, c;
+	struct stat st;
+	uLongf len;
+	off_t pos;
+	int ifd, ofd, err;
+	ssize_t n;
+
+	ifd = open(in, O_RDONLY);
+	if(ifd < 0)
+		return -1;
+	ofd = -1;
+	index = data = buf = NULL;
+	if(fstat(ifd, &st) < 0)
+		goto fail;
+	ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(ofd < 0)
+		goto fail;
+	nchunk = (st.st_size + CHUNK - 1) / CHUNK;
+	index = calloc(nchunk, 16);
+	data = malloc(CHUNK);
+	buf = malloc(compressBound(CHUNK));
+	if(index == NULL || data == NULL || buf == NULL)
+		goto fail;
+	pos = 32 + (off_t)nchunk * 16;
+	for(c = 0; c < nchunk; c++){
+		n = pread(ifd, data, CHUNK, (off_t)c * CHUNK);
+		if(n < 0)
+			goto fail;
+		memset(data + n, 0, CHUNK - n);
+		p = zpack(data, buf, &len);
+		if(len > 0 && pwrite(ofd, p, len, pos) != (ssize_t)len)
+			goto fail;
+		put64(index + (size_t)c * 16, pos);
+		put32(index + (size_t)c * 16 + 8, len);
+		put32(index + (size_t)c * 16 + 12, len);
+		pos += len;
+	}
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, Z_MAGIC, 8);
+	put32(hdr + 8, CHUNK);
+	put32(hdr + 12, nchunk);
+	put64(hdr + 16, st.st_size);
+	if(pwrite(ofd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	   pwrite(ofd, index, (size_t)nchunk * 16, 32) != (ssize_t)nchunk * 16)
+		goto fail;
+	free(index);
+	free(data);
+	free(buf);
+	close(ifd);
+	return close(ofd);
+fail:
+	err = errno;
+	free(index);
+	free(data);
+	free(buf);
+	close(ifd);
+	if(ofd >= 0)
+		close(ofd);
+	errno = err;
+	return -1;
+}
+
+static int
+ovl_open(CF *cf, char *path)
+{
+	uint8_t hdr[512];
+	struct stat st;
+	uint32_t bsect;
+
+	cf->ofd = open(path, O_RDWR | O_CREAT, 0666);
+	if(cf->ofd < 0)
+		return -1;
+	bsect = (cf->nsect + 4095) / 4096;
+	cf->blen = (size_t)bsect * 512;
+	cf->olen = (size_t)(1 + bsect + cf->nsect) * 512;
+	if(fstat(cf->ofd, &st) < 0)
+		return -1;
+	if(st.st_size == 0){
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, OVL_MAGIC, 8);
+		put32(hdr + 8, cf->nsect);
+		put32(hdr + 12, 1 + bsect);
+		if(pwrite(cf->ofd, hdr, sizeof(hdr), 0) != sizeof(hdr) || ftruncate(cf->ofd, cf->olen) < 0)
+			return -1;
+	}else if((size_t)st.st_size != cf->olen || pread(cf->ofd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	   memcmp(hdr, OVL_MAGIC, 8) != 0 || get32(hdr + 8) != cf->nsect || get32(hdr + 12) != 1 + bsect){
+		errno = EINVAL;
+		return -1;
+	}
+	cf->ovl = mmap(NULL, cf->olen, PROT_READ | PROT_WRITE, MAP_SHARED, cf->ofd, 0);
+	if(cf->ovl == MAP_FAILED){
+		cf->ovl = NULL;
+		return -1;
+	}
+	cf->bitmap = cf->ovl + 512;
+	cf->odata = cf->bitmap + cf->blen;
+	return 0;
+}
+
+/*
+ * Open a raw or compressed CF image. With an overlay the image is only
+ * read and every sector the guest writes goes to the overlay, created
+ * if missing.
+ */
+CF *
+cf_open(char *path, char *overlay)
+{
+	CF *cf;
+	char magic[8];
+	off_t size;
+	int fd, err;
+
+	cf = calloc(1, sizeof(CF));
+	if(cf == NULL)
+		return NULL;
+	cf->path = path;
+	cf->zfd = -1;
+	cf->ofd = -1;
+	fd = open(path, overlay ? O_RDONLY : O_RDWR);
+	if(fd < 0)
+		goto fail;
+	if(pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, Z_MAGIC, 8) == 0){
+		if(zopen(cf, fd) < 0){
+			if(cf->zfd < 0)
+				close(fd);
+			goto fail;
+		}
+	}else{
+		size = lseek(fd, 0, SEEK_END);
+		cf->nsect = size / 512;
+		cf->base = mmap(NULL, size, overlay ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(cf->base == MAP_FAILED){
+			cf->base = NULL;
+			goto fail;
+		}
+	}
+	if(overlay && ovl_open(cf, overlay) < 0)
+		goto fail;
+	return cf;
+fail:
+	err = errno;
+	cf_close(cf);
+	errno = err;
+	return NULL;
+}
+
+void
+cf_close(CF *cf)
+{
+	if(cf->ovl)
+		munmap(cf->ovl, cf->olen);
+	if(cf->ofd >= 0)
+		close(cf->ofd);
+	if(cf->base)
+		munmap(cf->base, (size_t)cf->nsect * 512);
+	if(cf->zfd >= 0){
+		if(cf->slot)
+			zsync(cf);
+		close(cf->zfd);
+	}
+	free(cf->index);
+	free(cf->cached);
+	free(cf->slot);
+	free(cf->zbuf);
+	free(cf);
+}
+
+off_t
+cf_size(CF *cf)
+{
+	return (off_t)cf->nsect * 512;
+}
+
+static uint8_t *
+base_sector(CF *cf, uint32_t lba, int write)
+{
+	if(cf->base)
+		return cf->base + (size_t)lba * 512;
+	return zsector(cf, lba, write);
+}
+
+/*
+ * 512 bytes of sector lba, copied up into the overlay first when
+ * written. Valid until the next call.
+ */
+uint8_t *
+cf_sector(CF *cf, uint32_t lba, int write)
+{
+	uint8_t *p;
+
+	if(lba >= cf->nsect)
+		return NULL;
+	if(cf->ovl == NULL)
+		return base_sector(cf, lba, write);
+	if(cf->bitmap[lba >> 3] & (1 << (lba & 7)))
+		return cf->odata + (size_t)lba * 512;
+	p = base_sector(cf, lba, 0);
+	if(!write || p == NULL)
+		return p;
+	memcpy(cf->odata + (size_t)lba * 512, p, 512);
+	cf->bitmap[lba >> 3] |= 1 << (lba & 7);
+	return cf->odata + (size_t)lba * 512;
+}
+
+/* write overlay sectors back into the image, then empty the overlay */
+int
+cf_commit(CF *cf)
+{
+	uint32_t lba;
+	uint8_t *p;
+	int fd, n;
+
+	if(cf->ovl == NULL)
+		return 0;
+	fd = open(cf->path, cf->zfd >= 0 ? O_RDWR : O_WRONLY);
+	if(fd < 0)
+		return -1;
+	if(cf->zfd >= 0){
+		dup2(fd, cf->zfd);
+		close(fd);
+		fd = cf->zfd;
+	}
+	n = 0;
+	for(lba = 0; lba < cf->nsect; lba++){
+		if(!(cf->bitmap[lba >> 3] & (1 << (lba & 7))))
+			continue;
+		if(cf->zfd >= 0){
+			p = zsector(cf, lba, 1);
+			if(p == NULL)
+				return -1;
+			memcpy(p, cf->odata + (size_t)lba * 512, 512);
+		}else if(pwrite(fd, cf->odata + (size_t)lba * 512, 512, (off_t)lba * 512) != 512){
+			close(fd);
+			return -1;
+		}
+		n++;
+	}
+	if(cf->zfd >= 0){
+		if(zsync(cf) < 0 || fsync(fd) < 0)
+			return -1;
+	}else if(fsync(fd) < 0 || close(fd) < 0)
+		return -1;
+	if(cf_discard(cf) < 0)
+		return -1;
+	return n;
+}
+
+/* forget every overlay sector and give its space back */
+int
+cf_discard(CF *cf)
+{
+	if(cf->ovl == NULL)
+		return 0;
+	memset(cf->bitmap, 0, cf->blen);
+	if(msync(cf->ovl, 512 + cf->blen, MS_SYNC) < 0)
+		return -1;
+	if(fallocate(cf->ofd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, cf->odata - cf->ovl, (off_t)cf->nsect * 512) < 0 && errno != EOPNOTSUPP)
+		return -1;
+	return 0;
+}
+
+/*
+ * Keep every write from now on in memory, private to this process and
+ * copy-on-write in any child forked later: an overlay is remapped
+ * privately, and an image without one gets an anonymous overlay after
+ * the cached chunks are written back.
+ */
+int
+cf_fork(CF *cf)
+{
+	uint8_t *p;
+	uint32_t bsect;
+
+	if(cf->ovl){
+		p = mmap(NULL, cf->olen, PROT_READ | PROT_WRITE, MAP_PRIVATE, cf->ofd, 0);
+		if(p == MAP_FAILED)
+			return -1;
+		munmap(cf->ovl, cf->olen);
+	}else{
+		bsect = (cf->nsect + 4095) / 4096;
+		cf->blen = (size_t)bsect * 512;
+		cf->olen = (size_t)(1 + bsect + cf->nsect) * 512;
+		p = mmap(NULL, cf->olen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED)
+			return -1;
+		if(cf->zfd >= 0 && zsync(cf) < 0){
+			munmap(p, cf->olen);
+			return -1;
+		}
+	}
+	if(cf->ofd >= 0)
+		close(cf->ofd);
+	cf->ofd = -1;
+	cf->ovl = p;
+	cf->bitmap = cf->ovl + 512;
+	cf->odata = cf->bitmap + cf->blen;
+	return 0;
+}
@@ -0,0 +1,10 @@
+typedef struct CF CF;
+
+CF *cf_open(char *path, char *overlay);
+void cf_close(CF *cf);
+off_t cf_size(CF *cf);
+uint8_t *cf_sector(CF *cf, uint32_t lba, int write);
+int cf_commit(CF *cf);
+int cf_discard(CF *cf);
+int cf_compress(char *in, char *out);
+int cf_fork(CF *cf);
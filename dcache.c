@@ -0,0 +1,881 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "8080/i8080.h"
+#include "dcache.h"
+
+/*
+ * Pre-decoded code: every 16 KB bank, the ROM and each bank of RAM, has
+ * a lazily allocated array with one entry per byte address. An entry
+ * holds the handler of the instruction starting there, its operand
+ * fetched and its cycle count, so executing it needs neither the
+ * read_byte callback nor an opcode decode. Tables belong to physical
+ * banks, so remapping a bank with the BANK port never invalidates
+ * them. Entries are dropped by dc_write() for every byte written
+ * through write_byte, and a 256-byte page at a time when its dirty bit
+ * shows it was overwritten in bulk. Instructions crossing a page are
+ * never kept.
+ *
+ * Semantics and cycle counts are those of the 8080/ core, state stays
+ * in its i8080 struct, and memory is written through its write_byte
+ * or the same way inline, so the two can take turns on one machine.
+ */
+#define ROM 17	/* code[] index */
+
+typedef struct Op Op;
+typedef void (*Fn)(DCache *, Op *);
+
+struct Op{
+	Fn fn;	/* NULL when not decoded */
+	uint16_t imm;
+	uint8_t len;
+	uint8_t cyc;
+	uint8_t x;	/* bits 5-3 of the opcode */
+	uint8_t y;	/* bits 2-0 */
+};
+
+struct DCache{
+	i8080 *cpu;
+	uint8_t **map;
+	uint8_t *rom;
+	uint8_t *ram;
+	uint8_t *dirty;
+	uint8_t bit;
+	uint32_t *wmap;	/* RAM offset written through each slot */
+	unsigned *writes;
+	uint8_t *r8[8];	/* B C D E H L - A */
+	Op *code[18];	/* RAM banks, the write sink, then the ROM */
+	Op tmp;
+};
+
+const uint8_t dc_cycles[256] = {
+	4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4,
+	4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4,
+	4, 10, 16, 5, 5, 5, 7, 4, 4, 10, 16, 5, 5, 5, 7, 4,
+	4, 10, 13, 5, 10, 10, 10, 4, 4, 10, 13, 5, 5, 5, 7, 4,
+	5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
+	5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
+	5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
+	7, 7, 7, 7, 7, 7, 7, 7, 5, 5, 5, 5, 5, 5, 7, 5,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	5, 10, 10, 10, 11, 11, 7, 11, 5, 10, 10, 10, 11, 17, 7, 11,
+	5, 10, 10, 10, 11, 11, 7, 11, 5, 10, 10, 10, 11, 17, 7, 11,
+	5, 10, 10, 18, 11, 11, 7, 11, 5, 5, 10, 4, 11, 17, 7, 11,
+	5, 10, 10, 4, 11, 11, 7, 11, 5, 5, 10, 4, 11, 17, 7, 11,
+};
+
+static inline uint8_t
+rb(DCache *d, uint16_t addr)
+{
+	return d->map[addr >> 14][addr & 0x3fff];
+}
+
+static inline void
+drop(DCache *d, uint32_t addr)
+{
+	Op *t;
+	int i;
+
+	t = d->code[addr >> 14];
+	if(t == NULL)
+		return;
+	for(i = 0; i < 3 && i <= (addr & 0x3fff); i++)
+		t[(addr & 0x3fff) - i].fn = NULL;
+}
+
+static inline void
+wb(DCache *d, uint16_t addr, uint8_t val)
+{
+#ifdef DC_INLINE
+	uint32_t a;
+
+	if(d->wmap){
+		a = d->wmap[addr >> 14] + (addr & 0x3fff);
+		d->ram[a] = val;
+		d->dirty[a >> 8] |= 0xff & ~d->bit;
+		drop(d, a);
+		(*d->writes)++;
+		return;
+	}
+#endif
+	d->cpu->write_byte(d->cpu->userdata, addr, val);
+}
+
+static inline uint16_t
+rw(DCache *d, uint16_t addr)
+{
+	return rb(d, addr) | rb(d, addr + 1) << 8;
+}
+
+static inline void
+ww(DCache *d, uint16_t addr, uint16_t val)
+{
+	wb(d, addr, val & 0xff);
+	wb(d, addr + 1, val >> 8);
+}
+
+static inline void
+push(DCache *d, uint16_t val)
+{
+	d->cpu->sp -= 2;
+	ww(d, d->cpu->sp, val);
+}
+
+static inline uint16_t
+pop(DCache *d)
+{
+	uint16_t val;
+
+	val = rw(d, d->cpu->sp);
+	d->cpu->sp += 2;
+	return val;
+}
+
+static inline uint16_t
+hl(i8080 *c)
+{
+	return c->h << 8 | c->l;
+}
+
+/* register pair p: BC, DE, HL, SP */
+static inline uint16_t
+getrp(DCache *d, int p)
+{
+	if(p == 3)
+		return d->cpu->sp;
+	return *d->r8[p * 2] << 8 | *d->r8[p * 2 + 1];
+}
+
+static inline void
+setrp(DCache *d, int p, uint16_t val)
+{
+	if(p == 3){
+		d->cpu->sp = val;
+		return;
+	}
+	*d->r8[p * 2] = val >> 8;
+	*d->r8[p * 2 + 1] = val;
+}
+
+static inline int
+parity(uint8_t v)
+{
+	v ^= v >> 4;
+	v ^= v >> 2;
+	v ^= v >> 1;
+	return !(v & 1);
+}
+
+static inline void
+szp(i8080 *c, uint8_t v)
+{
+	c->sf = v >> 7;
+	c->zf = v == 0;
+	c->pf = parity(v);
+}
+
+static inline int
+carry(int bit, uint8_t a, uint8_t b, int cy)
+{
+	int16_t r;
+
+	r = a + b + cy;
+	return ((r ^ a ^ b) & (1 << bit)) != 0;
+}
+
+static inline int
+cond(i8080 *c, int x)
+{
+	switch(x){
+	case 0: return !c->zf;
+	case 1: return c->zf;
+	case 2: return !c->cf;
+	case 3: return c->cf;
+	case 4: return !c->pf;
+	case 5: return c->pf;
+	case 6: return !c->sf;
+	}
+	return c->sf;
+}
+
+static inline void
+add(i8080 *c, uint8_t v, int cy)
+{
+	uint8_t r;
+
+	r = c->a + v + cy;
+	c->cf = carry(8, c->a, v, cy);
+	c->hf = carry(4, c->a, v, cy);
+	szp(c, r);
+	c->a = r;
+}
+
+static inline void
+sub(i8080 *c, uint8_t v, int cy)
+{
+	add(c, ~v, !cy);
+	c->cf = !c->cf;
+}
+
+static inline void
+alu_add(i8080 *c, uint8_t v)
+{
+	add(c, v, 0);
+}
+
+static inline void
+alu_adc(i8080 *c, uint8_t v)
+{
+	add(c, v, c->cf);
+}
+
+static inline void
+alu_sub(i8080 *c, uint8_t v)
+{
+	sub(c, v, 0);
+}
+
+static inline void
+alu_sbb(i8080 *c, uint8_t v)
+{
+	sub(c, v, c->cf);
+}
+
+static inline void
+alu_ana(i8080 *c, uint8_t v)
+{
+	uint8_t r;
+
+	r = c->a & v;
+	c->cf = 0;
+	c->hf = ((c->a | v) & 0x08) != 0;
+	szp(c, r);
+	c->a = r;
+}
+
+static inline void
+alu_xra(i8080 *c, uint8_t v)
+{
+	c->a ^= v;
+	c->cf = 0;
+	c->hf = 0;
+	szp(c, c->a);
+}
+
+static inline void
+alu_ora(i8080 *c, uint8_t v)
+{
+	c->a |= v;
+	c->cf = 0;
+	c->hf = 0;
+	szp(c, c->a);
+}
+
+static inline void
+alu_cmp(i8080 *c, uint8_t v)
+{
+	int16_t r;
+
+	r = c->a - v;
+	c->cf = r >> 8 != 0;
+	c->hf = (~(c->a ^ r ^ v) & 0x10) != 0;
+	szp(c, r);
+}
+
+static inline uint8_t
+inr(i8080 *c, uint8_t v)
+{
+	v++;
+	c->hf = (v & 0xf) == 0;
+	szp(c, v);
+	return v;
+}
+
+static inline uint8_t
+dcr(i8080 *c, uint8_t v)
+{
+	v--;
+	c->hf = (v & 0xf) != 0xf;
+	szp(c, v);
+	return v;
+}
+
+#define ALU(name) \
+static void op_##name##_r(DCache *d, Op *o) { alu_##name(d->cpu, *d->r8[o->y]); } \
+static void op_##name##_m(DCache *d, Op *o) { alu_##name(d->cpu, rb(d, hl(d->cpu))); } \
+static void op_##name##_i(DCache *d, Op *o) { alu_##name(d->cpu, o->imm); }
+
+ALU(add)
+ALU(adc)
+ALU(sub)
+ALU(sbb)
+ALU(ana)
+ALU(xra)
+ALU(ora)
+ALU(cmp)
+
+#undef ALU
+
+static const Fn alu[8][3] = {
+	{op_add_r, op_add_m, op_add_i},
+	{op_adc_r, op_adc_m, op_adc_i},
+	{op_sub_r, op_sub_m, op_sub_i},
+	{op_sbb_r, op_sbb_m, op_sbb_i},
+	{op_ana_r, op_ana_m, op_ana_i},
+	{op_xra_r, op_xra_m, op_xra_i},
+	{op_ora_r, op_ora_m, op_ora_i},
+	{op_cmp_r, op_cmp_m, op_cmp_i},
+};
+
+static void
+op_nop(DCache *d, Op *o)
+{
+}
+
+static void
+op_hlt(DCache *d, Op *o)
+{
+	d->cpu->halted = 1;
+}
+
+static void
+op_movrr(DCache *d, Op *o)
+{
+	*d->r8[o->x] = *d->r8[o->y];
+}
+
+static void
+op_movrm(DCache *d, Op *o)
+{
+	*d->r8[o->x] = rb(d, hl(d->cpu));
+}
+
+static void
+op_movmr(DCache *d, Op *o)
+{
+	wb(d, hl(d->cpu), *d->r8[o->y]);
+}
+
+static void
+op_mvi(DCache *d, Op *o)
+{
+	*d->r8[o->x] = o->imm;
+}
+
+static void
+op_mvim(DCache *d, Op *o)
+{
+	wb(d, hl(d->cpu), o->imm);
+}
+
+static void
+op_inr(DCache *d, Op *o)
+{
+	*d->r8[o->x] = inr(d->cpu, *d->r8[o->x]);
+}
+
+static void
+op_inrm(DCache *d, Op *o)
+{
+	wb(d, hl(d->cpu), inr(d->cpu, rb(d, hl(d->cpu))));
+}
+
+static void
+op_dcr(DCache *d, Op *o)
+{
+	*d->r8[o->x] = dcr(d->cpu, *d->r8[o->x]);
+}
+
+static void
+op_dcrm(DCache *d, Op *o)
+{
+	wb(d, hl(d->cpu), dcr(d->cpu, rb(d, hl(d->cpu))));
+}
+
+static void
+op_lxi(DCache *d, Op *o)
+{
+	setrp(d, o->x >> 1, o->imm);
+}
+
+static void
+op_inx(DCache *d, Op *o)
+{
+	setrp(d, o->x >> 1, getrp(d, o->x >> 1) + 1);
+}
+
+static void
+op_dcx(DCache *d, Op *o)
+{
+	setrp(d, o->x >> 1, getrp(d, o->x >> 1) - 1);
+}
+
+static void
+op_stax(DCache *d, Op *o)
+{
+	wb(d, getrp(d, o->x >> 1), d->cpu->a);
+}
+
+static void
+op_ldax(DCache *d, Op *o)
+{
+	d->cpu->a = rb(d, getrp(d, o->x >> 1));
+}
+
+static void
+op_sta(DCache *d, Op *o)
+{
+	wb(d, o->imm, d->cpu->a);
+}
+
+static void
+op_lda(DCache *d, Op *o)
+{
+	d->cpu->a = rb(d, o->imm);
+}
+
+static void
+op_shld(DCache *d, Op *o)
+{
+	ww(d, o->imm, hl(d->cpu));
+}
+
+static void
+op_lhld(DCache *d, Op *o)
+{
+	setrp(d, 2, rw(d, o->imm));
+}
+
+static void
+op_cma(DCache *d, Op *o)
+{
+	d->cpu->a = ~d->cpu->a;
+}
+
+static void
+op_stc(DCache *d, Op *o)
+{
+	d->cpu->cf = 1;
+}
+
+static void
+op_cmc(DCache *d, Op *o)
+{
+	d->cpu->cf = !d->cpu->cf;
+}
+
+static void
+op_jmp(DCache *d, Op *o)
+{
+	d->cpu->pc = o->imm;
+}
+
+static void
+op_pchl(DCache *d, Op *o)
+{
+	d->cpu->pc = hl(d->cpu);
+}
+
+static void
+op_sphl(DCache *d, Op *o)
+{
+	d->cpu->sp = hl(d->cpu);
+}
+
+static void
+op_ret(DCache *d, Op *o)
+{
+	d->cpu->pc = pop(d);
+}
+
+static void
+op_pop(DCache *d, Op *o)
+{
+	setrp(d, o->x >> 1, pop(d));
+}
+
+static void
+op_push(DCache *d, Op *o)
+{
+	push(d, getrp(d, o->x >> 1));
+}
+
+static void
+op_di(DCache *d, Op *o)
+{
+	d->cpu->iff = 0;
+}
+
+static void
+op_out(DCache *d, Op *o)
+{
+	d->cpu->port_out(d->cpu->userdata, o->imm, d->cpu->a);
+}
+
+static void
+op_in(DCache *d, Op *o)
+{
+	d->cpu->a = d->cpu->port_in(d->cpu->userdata, o->imm);
+}
+
+static void
+op_dad(DCache *d, Op *o)
+{
+	uint32_t r;
+
+	r = hl(d->cpu) + getrp(d, o->x >> 1);
+	d->cpu->cf = (r >> 16) & 1;
+	setrp(d, 2, r);
+}
+
+static void
+op_rlc(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+
+	c->cf = c->a >> 7;
+	c->a = c->a << 1 | c->cf;
+}
+
+static void
+op_rrc(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+
+	c->cf = c->a & 1;
+	c->a = c->a >> 1 | c->cf << 7;
+}
+
+static void
+op_ral(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+	int cy;
+
+	cy = c->cf;
+	c->cf = c->a >> 7;
+	c->a = c->a << 1 | cy;
+}
+
+static void
+op_rar(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+	int cy;
+
+	cy = c->cf;
+	c->cf = c->a & 1;
+	c->a = c->a >> 1 | cy << 7;
+}
+
+static void
+op_daa(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+	uint8_t fix, lsb, msb;
+	int cy;
+
+	cy = c->cf;
+	fix = 0;
+	lsb = c->a & 0x0f;
+	msb = c->a >> 4;
+	if(c->hf || lsb > 9)
+		fix += 0x06;
+	if(c->cf || msb > 9 || (msb >= 9 && lsb > 9)){
+		fix += 0x60;
+		cy = 1;
+	}
+	add(c, fix, 0);
+	c->cf = cy;
+}
+
+static void
+op_xthl(DCache *d, Op *o)
+{
+	uint16_t v;
+
+	v = rw(d, d->cpu->sp);
+	ww(d, d->cpu->sp, hl(d->cpu));
+	setrp(d, 2, v);
+}
+
+static void
+op_xchg(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+	uint8_t t;
+
+	t = c->d;
+	c->d = c->h;
+	c->h = t;
+	t = c->e;
+	c->e = c->l;
+	c->l = t;
+}
+
+static void
+op_ei(DCache *d, Op *o)
+{
+	d->cpu->iff = 1;
+	d->cpu->interrupt_delay = 1;
+}
+
+static void
+op_poppsw(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+	uint16_t v;
+
+	v = pop(d);
+	c->a = v >> 8;
+	c->sf = (v >> 7) & 1;
+	c->zf = (v >> 6) & 1;
+	c->hf = (v >> 4) & 1;
+	c->pf = (v >> 2) & 1;
+	c->cf = v & 1;
+}
+
+static void
+op_pushpsw(DCache *d, Op *o)
+{
+	i8080 *c = d->cpu;
+
+	push(d, c->a << 8 | c->sf << 7 | c->zf << 6 | c->hf << 4 | c->pf << 2 | 1 << 1 | c->cf);
+}
+
+static void
+op_call(DCache *d, Op *o)
+{
+	push(d, d->cpu->pc);
+	d->cpu->pc = o->imm;
+}
+
+static void
+op_jcc(DCache *d, Op *o)
+{
+	if(cond(d->cpu, o->x))
+		d->cpu->pc = o->imm;
+}
+
+static void
+op_ccc(DCache *d, Op *o)
+{
+	if(cond(d->cpu, o->x)){
+		op_call(d, o);
+		d->cpu->cyc += 6;
+	}
+}
+
+static void
+op_rcc(DCache *d, Op *o)
+{
+	if(cond(d->cpu, o->x)){
+		op_ret(d, o);
+		d->cpu->cyc += 6;
+	}
+}
+
+static const Fn misc0[8] = {op_rlc, op_rrc, op_ral, op_rar, op_daa, op_cma, op_stc, op_cmc};
+static const Fn mem0[8] = {op_stax, op_ldax, op_stax, op_ldax, op_shld, op_lhld, op_sta, op_lda};
+static const Fn misc3[8] = {op_jmp, op_jmp, op_out, op_in, op_xthl, op_xchg, op_di, op_ei};
+static const Fn ret3[4] = {op_ret, op_ret, op_pchl, op_sphl};
+
+/*
+ * Decode opcode op with its operand bytes at addr into o; undocumented
+ * opcodes alias documented ones as in the 8080/ core.
+ */
+static void
+decode(DCache *d, Op *o, uint8_t op, uint16_t addr)
+{
+	int x, y, n;
+
+	x = (op >> 3) & 7;
+	y = op & 7;
+	o->x = x;
+	o->y = y;
+	o->cyc = dc_cycles[op];
+	n = 0;
+	switch(op >> 6){
+	case 0:
+		switch(y){
+		case 0: o->fn = op_nop; break;
+		case 1: o->fn = x & 1 ? op_dad : op_lxi; n = x & 1 ? 0 : 2; break;
+		case 2: o->fn = mem0[x]; n = x >= 4 ? 2 : 0; break;
+		case 3: o->fn = x & 1 ? op_dcx : op_inx; break;
+		case 4: o->fn = x == 6 ? op_inrm : op_inr; break;
+		case 5: o->fn = x == 6 ? op_dcrm : op_dcr; break;
+		case 6: o->fn = x == 6 ? op_mvim : op_mvi; n = 1; break;
+		case 7: o->fn = misc0[x]; break;
+		}
+		break;
+	case 1:
+		if(op == 0x76)
+			o->fn = op_hlt;
+		else if(x == 6)
+			o->fn = op_movmr;
+		else if(y == 6)
+			o->fn = op_movrm;
+		else
+			o->fn = op_movrr;
+		break;
+	case 2:
+		o->fn = alu[x][y == 6];
+		break;
+	case 3:
+		switch(y){
+		case 0: o->fn = op_rcc; break;
+		case 1: o->fn = x & 1 ? ret3[x >> 1] : x == 6 ? op_poppsw : op_pop; break;
+		case 2: o->fn = op_jcc; n = 2; break;
+		case 3: o->fn = misc3[x]; n = x < 2 ? 2 : x < 4 ? 1 : 0; break;
+		case 4: o->fn = op_ccc; n = 2; break;
+		case 5: o->fn = x & 1 ? op_call : x == 6 ? op_pushpsw : op_push; n = x & 1 ? 2 : 0; break;
+		case 6: o->fn = alu[x][2]; n = 1; break;
+		case 7: o->fn = op_call; o->imm = x << 3; break;	/* RST */
+		}
+		break;
+	}
+	if(n == 1)
+		o->imm = rb(d, addr);
+	else if(n == 2)
+		o->imm = rw(d, addr);
+	o->len = 1 + n;
+}
+
+/*
+ * The decoded instruction at pc: the cached entry when it can be kept,
+ * otherwise decoded afresh into d->tmp.
+ */
+static inline Op *
+fetch(DCache *d, uint16_t pc)
+{
+	uint8_t *page;
+	uint32_t off;
+	Op *t, *o;
+	int b;
+
+	page = d->map[pc >> 14];
+	off = pc & 0x3fff;
+	if(page == d->rom)
+		b = ROM;
+	else{
+		b = (page - d->ram) >> 14;
+		if(d->dirty[(page - d->ram + off) >> 8] & d->bit){
+			d->dirty[(page - d->ram + off) >> 8] &= ~d->bit;
+			if(d->code[b])
+				memset(d->code[b] + (off & ~0xff), 0, 256 * sizeof(Op));
+		}
+	}
+	t = d->code[b];
+	if(t == NULL)
+		t = d->code[b] = calloc(0x4000, sizeof(Op));
+	if(t && t[off].fn)
+		return &t[off];
+	o = &d->tmp;
+	decode(d, o, page[off], pc + 1);
+	if(t && (b == ROM ? off + o->len <= 0x4000 : (off & 0xff) + o->len <= 256)){
+		t[off] = *o;
+		o = &t[off];
+	}
+	return o;
+}
+
+DCache *
+dc_new(i8080 *cpu, uint8_t **map, uint8_t *rom, uint8_t *ram, uint8_t *dirty, uint8_t bit)
+{
+	DCache *d;
+
+	d = calloc(1, sizeof(DCache));
+	if(d == NULL)
+		return NULL;
+	d->cpu = cpu;
+	d->map = map;
+	d->rom = rom;
+	d->ram = ram;
+	d->dirty = dirty;
+	d->bit = bit;
+	d->r8[0] = &cpu->b;
+	d->r8[1] = &cpu->c;
+	d->r8[2] = &cpu->d;
+	d->r8[3] = &cpu->e;
+	d->r8[4] = &cpu->h;
+	d->r8[5] = &cpu->l;
+	d->r8[6] = NULL;
+	d->r8[7] = &cpu->a;
+	return d;
+}
+
+void
+dc_free(DCache *d)
+{
+	int i;
+
+	for(i = 0; i < 18; i++)
+		free(d->code[i]);
+	free(d);
+}
+
+/* byte addr of RAM was written: drop the instructions it was part of */
+void
+dc_write(DCache *d, uint32_t addr)
+{
+	drop(d, addr);
+}
+
+/*
+ * With DC_INLINE, store to memory directly instead of through
+ * write_byte: at wmap[slot] plus the offset, with the ROM slots
+ * pointing at a sink bank past the RAM, marking the dirty page and
+ * counting the write in *writes as write_byte would. NULL wmap goes
+ * back to write_byte.
+ */
+void
+dc_wmap(DCache *d, uint32_t *wmap, unsigned *writes)
+{
+	d->wmap = wmap;
+	d->writes = writes;
+}
+
+/*
+ * Run until the cycle count reaches *stop or the CPU halts, taking an
+ * interrupt as RST 7 while any mask bit of *irq is set, as run() does
+ * around i8080_step(). Returns the instructions executed, not counting
+ * HLT.
+ */
+unsigned long
+dc_run(DCache *d, uint64_t *stop, uint8_t *irq, uint8_t mask)
+{
+	i8080 *c;
+	unsigned long n;
+	Op *o, v;
+
+	c = d->cpu;
+	n = 0;
+	while(c->cyc < *stop){
+		if(c->iff && (*irq & mask))
+			i8080_interrupt(c, 0xff);
+		if(c->interrupt_pending && c->iff && c->interrupt_delay == 0){
+			c->interrupt_pending = 0;
+			c->iff = 0;
+			c->halted = 0;
+			o = &v;
+			decode(d, o, c->interrupt_vector, c->pc);
+			c->pc += o->len - 1;
+		}else if(c->halted)
+			break;
+		else{
+			o = fetch(d, c->pc);
+			c->pc += o->len;
+		}
+		c->cyc += o->cyc;
+		if(c->interrupt_delay > 0)
+			c->interrupt_delay--;
+		o->fn(d, o);
+		if(!c->halted)
+			n++;
+	}
+	return n;
+}
@@ -0,0 +1,9 @@
+typedef struct DCache DCache;
+
+extern const uint8_t dc_cycles[256];
+
+DCache *dc_new(i8080 *cpu, uint8_t **map, uint8_t *rom, uint8_t *ram, uint8_t *dirty, uint8_t bit);
+void dc_free(DCache *d);
+void dc_write(DCache *d, uint32_t addr);
+void dc_wmap(DCache *d, uint32_t *wmap, unsigned *writes);
+unsigned long dc_run(DCache *d, uint64_t *stop, uint8_t *irq, uint8_t mask);
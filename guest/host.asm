@@ -0,0 +1,230 @@
+; H.COM: copy files between CP/M and the directory given to pac80emu -H
+;
+;	H G NAME.EXT	host file to CP/M
+;	H P NAME.EXT	CP/M file to host
+;
+; Host names are the CP/M name in lower case. Moves 8 KB per HOST
+; command; a file fetched from the host is padded with ^Z to a record.
+
+BDOS	EQU	5
+FCB1	EQU	5CH
+FCB2	EQU	6CH
+TBUF	EQU	80H
+
+HCMD	EQU	00H		; HOST device on EXT0: command, status
+HNAME	EQU	01H
+HADRL	EQU	02H
+HADRH	EQU	03H
+HCNTL	EQU	04H
+HCNTH	EQU	05H
+
+HEOF	EQU	04H
+HERR	EQU	80H
+
+BUF	EQU	1000H		; record aligned
+BUFSZ	EQU	2000H
+
+	ORG	100H
+	LXI	H,FCB2		; the file argument, before we overwrite it
+	LXI	D,FCB
+	MVI	B,12
+COPY:	MOV	A,M
+	STAX	D
+	INX	H
+	INX	D
+	DCR	B
+	JNZ	COPY
+	XRA	A
+	MVI	B,24
+CLEAR:	STAX	D
+	INX	D
+	DCR	B
+	JNZ	CLEAR
+	LDA	FCB1+1
+	CPI	'G'
+	JZ	GET
+	CPI	'P'
+	JZ	PUT
+	LXI	D,MUSAGE
+	JMP	FAIL
+
+GET:	CALL	SNAME
+	MVI	A,1		; open for reading
+	CALL	CMD
+	LXI	D,FCB
+	MVI	C,19		; delete
+	CALL	BDOS
+	LXI	D,FCB
+	MVI	C,22		; make
+	CALL	BDOS
+	INR	A
+	JZ	DFULL
+GLOOP:	CALL	SBUF
+	XRA	A
+	OUT	HCNTL
+	MVI	A,BUFSZ SHR 8
+	OUT	HCNTH
+	MVI	A,3		; read
+	CALL	CMD
+	ANI	HEOF
+	JNZ	GDONE
+	IN	HCNTL
+	MOV	L,A
+	IN	HCNTH
+	MOV	H,A
+	LXI	D,BUF
+	DAD	D
+GPAD:	MOV	A,L
+	ANI	7FH
+	JZ	GPADX
+	MVI	M,1AH
+	INX	H
+	JMP	GPAD
+GPADX:	SHLD	PEND
+	LXI	H,BUF
+	SHLD	PTR
+GW:	LHLD	PTR
+	XCHG
+	LHLD	PEND
+	MOV	A,E
+	CMP	L
+	JNZ	GW1
+	MOV	A,D
+	CMP	H
+	JZ	GLOOP
+GW1:	MVI	C,26		; set DMA to DE
+	CALL	BDOS
+	LXI	D,FCB
+	MVI	C,21		; write sequential
+	CALL	BDOS
+	ORA	A
+	JNZ	DFULL
+	CALL	NEXT
+	JMP	GW
+GDONE:	MVI	A,5		; close
+	CALL	CMD
+	LXI	D,FCB
+	MVI	C,16		; close
+	CALL	BDOS
+	JMP	DONE
+
+PUT:	LXI	D,FCB
+	MVI	C,15		; open
+	CALL	BDOS
+	INR	A
+	JZ	NOFILE
+	CALL	SNAME
+	MVI	A,2		; create
+	CALL	CMD
+PLOOP:	LXI	H,BUF
+	SHLD	PTR
+PREAD:	LHLD	PTR
+	XCHG
+	MVI	C,26
+	CALL	BDOS
+	LXI	D,FCB
+	MVI	C,20		; read sequential
+	CALL	BDOS
+	ORA	A
+	JNZ	PLAST
+	CALL	NEXT
+	LHLD	PTR
+	MOV	A,H
+	CPI	(BUF+BUFSZ) SHR 8
+	JNZ	PREAD
+	CALL	PSEND
+	JMP	PLOOP
+PLAST:	CALL	PSEND
+	MVI	A,5
+	CALL	CMD
+	JMP	DONE
+
+; write BUF up to PTR to the host
+PSEND:	CALL	SBUF
+	LHLD	PTR
+	MOV	A,L
+	SUI	BUF AND 0FFH
+	OUT	HCNTL
+	MOV	A,H
+	SBI	BUF SHR 8
+	OUT	HCNTH
+	MVI	A,4		; write
+	JMP	CMD
+
+; PTR to the next record
+NEXT:	LHLD	PTR
+	LXI	D,128
+	DAD	D
+	SHLD	PTR
+	RET
+
+; point the HOST device at BUF
+SBUF:	MVI	A,BUF AND 0FFH
+	OUT	HADRL
+	MVI	A,BUF SHR 8
+	OUT	HADRH
+	RET
+
+; issue command A, returning the status; gives up on an error
+CMD:	OUT	HCMD
+	IN	HCMD
+	MOV	B,A
+	ANI	HERR
+	JNZ	HFAIL
+	MOV	A,B
+	RET
+
+; send the name in FCB, lower case, without blanks
+SNAME:	LXI	H,FCB+1
+	MVI	B,8
+SN1:	MOV	A,M
+	CALL	PUTC
+	INX	H
+	DCR	B
+	JNZ	SN1
+	MOV	A,M
+	CPI	' '
+	RZ
+	MVI	A,'.'
+	OUT	HNAME
+	MVI	B,3
+SN2:	MOV	A,M
+	CALL	PUTC
+	INX	H
+	DCR	B
+	JNZ	SN2
+	RET
+
+PUTC:	ANI	7FH
+	CPI	' '
+	RZ
+	CPI	'A'
+	JC	PUTC1
+	CPI	'Z'+1
+	JNC	PUTC1
+	ORI	20H
+PUTC1:	OUT	HNAME
+	RET
+
+HFAIL:	LXI	D,MHOST
+	JMP	FAIL
+DFULL:	LXI	D,MDISK
+	JMP	FAIL
+NOFILE:	LXI	D,MNOF
+FAIL:	MVI	C,9
+	CALL	BDOS
+DONE:	LXI	D,TBUF
+	MVI	C,26
+	CALL	BDOS
+	JMP	0
+
+MUSAGE:	DB	'usage: H G|P NAME.EXT$'
+MHOST:	DB	'host file error$'
+MDISK:	DB	'disk full$'
+MNOF:	DB	'no file$'
+
+PTR:	DS	2
+PEND:	DS	2
+FCB:	DS	36
+
+	END
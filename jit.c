@@ -0,0 +1,1299 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "8080/i8080.h"
+#include "dcache.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+/*
+ * Basic-block translator for x86-64 hosts. A block is a run of up to
+ * MAX_INS instructions inside one 256-byte page, ending at a jump,
+ * call, return or RST, at the page end, or before an instruction left
+ * to the interpreter: IN, OUT, EI, DI, HLT and DAA. Ports, interrupts
+ * and halts are thus only ever seen by the interpreter, and a block
+ * needs no check inside: it is entered only when all but its last
+ * instruction start before the cycle budget, as the interpreter would
+ * have run them.
+ *
+ * Registers stay in the i8080 struct (rbx); flags are kept in PSW
+ * layout in the Jit struct (rbp), which LAHF produces directly. Flags
+ * are evaluated lazily: an instruction whose flags are all redefined
+ * before anything in the block reads them does not compute them.
+ * Memory is read through the bank map inline and written through
+ * write_byte; a write that hits a page holding translated code flushes
+ * the whole cache and leaves the block after that instruction.
+ *
+ * A static exit returns a Link the dispatcher patches into a direct
+ * jump to the next block, when that one lies in the same bank and
+ * 16 KB slot and so is reached under any mapping that reached this
+ * one. A chained block checks the cycle budget on entry.
+ */
+#define CODE_SIZE  (4 << 20)
+#define CODE_SLACK 16384	/* more than any block */
+#define MAX_BLOCKS 32768
+#define MAX_LINKS  65536
+#define MAX_INS    32
+#define BAN        4	/* flushes before a page is left to the interpreter */
+#define LOG_MAX    256
+
+enum{
+	CY = 1,	/* carry */
+	SZHP = 2,	/* the other flags */
+	ALL = 3
+};
+
+enum{
+	EXIT_LINK,	/* to a known pc, may be chained */
+	EXIT_PC,	/* to a known pc */
+	EXIT_DYN	/* pc already stored */
+};
+
+/* x86 registers */
+enum{
+	EAX = 0,
+	ECX = 1,
+	EDX = 2,
+	RBX = 3,
+	AH = 4,
+	RBP = 5
+};
+
+typedef struct Block Block;
+struct Block{
+	uint8_t *chain;	/* checks the budget */
+	uint8_t *body;
+	uint64_t fit;	/* cycles before the last instruction */
+	uint16_t pc;
+	uint8_t bank;
+};
+
+typedef struct Link Link;
+struct Link{
+	uint8_t *site;	/* rel32 of the jump to patch */
+	Block *from;
+	uint16_t to;
+};
+
+typedef struct Ins Ins;
+struct Ins{
+	uint8_t op;
+	uint8_t len;
+	uint8_t live;	/* flags it must compute */
+	uint16_t imm;
+	uint16_t pc;
+};
+
+typedef struct Exit Exit;
+struct Exit{
+	uint8_t *site;
+	uint8_t kind;
+	uint8_t n;
+	uint16_t pc;
+	uint32_t cyc;
+};
+
+typedef uint8_t *(*Enter)(i8080 *, Jit *, uint8_t *);
+
+struct Jit{
+	/* addressed from generated code: keep within 128 bytes */
+	uint8_t f;
+	uint8_t smc;
+	uint8_t tmp[2];
+	uint64_t insns;
+	uint64_t stop;
+	uint8_t **map;
+
+	i8080 *cpu;
+	DCache *dc;
+	uint8_t *rom;
+	uint8_t *ram;
+	int diff;
+	uint8_t reg[8];	/* offsets of B C D E H L - A */
+	uint8_t *code;
+	uint8_t *base;	/* past the entry and exit code */
+	uint8_t *p;
+	uint8_t *epilogue;
+	Enter enter;
+	Block *blk;
+	int nblk;
+	Link *link;
+	int nlink;
+	Block none;
+	Block **tab[17];	/* RAM banks, then the ROM */
+	uint8_t hascode[1024];
+	uint8_t ban[1024];
+	unsigned gen;
+	Exit exit[MAX_INS * 3];
+	int nexit;
+	int logging;
+	int nlog;
+	struct{
+		uint32_t addr;
+		uint8_t old;
+	} log[LOG_MAX];
+	uint64_t ninsns;	/* run natively */
+	uint64_t nblocks;
+	uint64_t nflush;
+};
+
+#define C(f) ((int)offsetof(i8080, f))
+#define J(f) ((int)offsetof(Jit, f))
+#define E(...) emit(j, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void
+emit(Jit *j, const uint8_t *b, size_t n)
+{
+	memcpy(j->p, b, n);
+	j->p += n;
+}
+
+static void
+e16(Jit *j, uint16_t v)
+{
+	memcpy(j->p, &v, 2);
+	j->p += 2;
+}
+
+static void
+e32(Jit *j, uint32_t v)
+{
+	memcpy(j->p, &v, 4);
+	j->p += 4;
+}
+
+static void
+e64(Jit *j, uint64_t v)
+{
+	memcpy(j->p, &v, 8);
+	j->p += 8;
+}
+
+static void
+rel32(uint8_t *site, uint8_t *to)
+{
+	int32_t d;
+
+	d = to - (site + 4);
+	memcpy(site, &d, 4);
+}
+
+/* ModRM for [base+disp8] */
+static void
+mem(Jit *j, int r, int base, int disp)
+{
+	E(0x40 | r << 3 | base, disp);
+}
+
+/* movzx r32, byte [base+d] */
+static void
+ldb(Jit *j, int r, int base, int d)
+{
+	E(0x0f, 0xb6);
+	mem(j, r, base, d);
+}
+
+/* movzx r32, word [base+d] */
+static void
+ldw(Jit *j, int r, int base, int d)
+{
+	E(0x0f, 0xb7);
+	mem(j, r, base, d);
+}
+
+/* mov [base+d], r8 */
+static void
+stb(Jit *j, int r, int base, int d)
+{
+	E(0x88);
+	mem(j, r, base, d);
+}
+
+/* mov [base+d], r16 */
+static void
+stw(Jit *j, int r, int base, int d)
+{
+	E(0x66, 0x89);
+	mem(j, r, base, d);
+}
+
+/* op byte [base+d], imm8; ext 0 add, 1 or, 4 and, 6 xor, 7 cmp */
+static void
+opb(Jit *j, int ext, int base, int d, uint8_t imm)
+{
+	E(0x80);
+	mem(j, ext, base, d);
+	E(imm);
+}
+
+static void
+movb(Jit *j, int base, int d, uint8_t imm)
+{
+	E(0xc6);
+	mem(j, 0, base, d);
+	E(imm);
+}
+
+static void
+movw(Jit *j, int base, int d, uint16_t imm)
+{
+	E(0x66, 0xc7);
+	mem(j, 0, base, d);
+	e16(j, imm);
+}
+
+/* mov r32, imm32 */
+static void
+movi(Jit *j, int r, uint32_t v)
+{
+	E(0xb8 + r);
+	e32(j, v);
+}
+
+static void
+jmp(Jit *j, uint8_t *to)
+{
+	E(0xe9);
+	e32(j, 0);
+	rel32(j->p - 4, to);
+}
+
+/* register pair p (BC DE HL SP) into cx, and back */
+static void
+getrp(Jit *j, int p)
+{
+	if(p == 3){
+		ldw(j, ECX, RBX, C(sp));
+		return;
+	}
+	ldw(j, ECX, RBX, j->reg[p * 2]);
+	E(0x66, 0xc1, 0xc1, 0x08);	/* rol cx, 8 */
+}
+
+static void
+putrp(Jit *j, int p)
+{
+	if(p == 3){
+		stw(j, ECX, RBX, C(sp));
+		return;
+	}
+	E(0x66, 0xc1, 0xc1, 0x08);
+	stw(j, ECX, RBX, j->reg[p * 2]);
+}
+
+/* eax = memory at cx; clobbers ecx, edx */
+static void
+rd(Jit *j)
+{
+	E(0x89, 0xc8);	/* mov eax, ecx */
+	E(0xc1, 0xe8, 0x0e);	/* shr eax, 14 */
+	E(0x48, 0x8b);	/* mov rdx, [rbp+map] */
+	mem(j, EDX, RBP, J(map));
+	E(0x48, 0x8b, 0x14, 0xc2);	/* mov rdx, [rdx+rax*8] */
+	E(0x81, 0xe1, 0xff, 0x3f, 0x00, 0x00);	/* and ecx, 0x3fff */
+	E(0x0f, 0xb6, 0x04, 0x0a);	/* movzx eax, byte [rdx+rcx] */
+}
+
+static void
+wb(Jit *j, uint32_t addr, uint32_t val)
+{
+	j->cpu->write_byte(j->cpu->userdata, addr, val);
+}
+
+/* memory at cx = dl */
+static void
+wr(Jit *j)
+{
+	E(0x89, 0xce);	/* mov esi, ecx */
+	E(0x48, 0x89, 0xef);	/* mov rdi, rbp */
+	E(0x48, 0xb8);	/* mov rax, wb */
+	e64(j, (uintptr_t)wb);
+	E(0xff, 0xd0);	/* call rax */
+}
+
+/* the rel32 just emitted leads to an exit */
+static void
+toexit(Jit *j, int kind, uint16_t pc, uint32_t cyc, int n)
+{
+	Exit *x;
+
+	e32(j, 0);
+	x = &j->exit[j->nexit++];
+	x->site = j->p - 4;
+	x->kind = kind;
+	x->pc = pc;
+	x->cyc = cyc;
+	x->n = n;
+}
+
+/* leave the block if a write hit translated code */
+static void
+smc(Jit *j, uint16_t pc, uint32_t cyc, int n)
+{
+	opb(j, 7, RBP, J(smc), 0);
+	E(0x0f, 0x85);	/* jne */
+	toexit(j, EXIT_PC, pc, cyc, n);
+}
+
+/* push a 16-bit value, from cx or, with imm set, val */
+static void
+push(Jit *j, int imm, uint16_t val)
+{
+	if(!imm)
+		stw(j, ECX, RBP, J(tmp));
+	ldw(j, ECX, RBX, C(sp));
+	E(0x66, 0x83, 0xe9, 0x02);	/* sub cx, 2 */
+	stw(j, ECX, RBX, C(sp));
+	if(imm)
+		movi(j, EDX, val & 0xff);
+	else
+		ldb(j, EDX, RBP, J(tmp));
+	wr(j);
+	ldw(j, ECX, RBX, C(sp));
+	E(0x66, 0xff, 0xc1);	/* inc cx */
+	if(imm)
+		movi(j, EDX, val >> 8);
+	else
+		ldb(j, EDX, RBP, J(tmp) + 1);
+	wr(j);
+}
+
+/* pop into tmp */
+static void
+pop(Jit *j)
+{
+	ldw(j, ECX, RBX, C(sp));
+	rd(j);
+	stb(j, EAX, RBP, J(tmp));
+	ldw(j, ECX, RBX, C(sp));
+	E(0x66, 0xff, 0xc1);
+	rd(j);
+	stb(j, EAX, RBP, J(tmp) + 1);
+	E(0x66, 0x83);	/* add word [rbx+sp], 2 */
+	mem(j, 0, RBX, C(sp));
+	E(0x02);
+}
+
+/* carry of the last x86 operation into the flags */
+static void
+setcy(Jit *j)
+{
+	E(0x0f, 0x92, 0xc2);	/* setc dl */
+	opb(j, 4, RBP, J(f), 0xfe);
+	E(0x08);	/* or [rbp+f], dl */
+	mem(j, EDX, RBP, J(f));
+}
+
+/* x86 CF = flag CY */
+static void
+getcy(Jit *j)
+{
+	ldb(j, EDX, RBP, J(f));
+	E(0xd0, 0xea);	/* shr dl, 1 */
+}
+
+/* branch to exit when condition x of Jcc, Ccc or Rcc fails */
+static void
+unless(Jit *j, int x, uint16_t pc, uint32_t cyc, int n)
+{
+	static const uint8_t mask[4] = {0x40, 0x01, 0x04, 0x80};	/* Z C P S */
+
+	E(0xf6);	/* test byte [rbp+f], mask */
+	mem(j, 0, RBP, J(f));
+	E(mask[x >> 1]);
+	E(0x0f, x & 1 ? 0x84 : 0x85);
+	toexit(j, EXIT_LINK, pc, cyc, n);
+}
+
+static int
+oplen(uint8_t op)
+{
+	int x, y;
+
+	x = (op >> 3) & 7;
+	y = op & 7;
+	switch(op >> 6){
+	case 0:
+		if(y == 1 && !(x & 1))
+			return 3;
+		if(y == 2 && x >= 4)
+			return 3;
+		if(y == 6)
+			return 2;
+		return 1;
+	case 3:
+		if(y == 2 || y == 4 || (y == 3 && x < 2) || (y == 5 && (x & 1)))
+			return 3;
+		if(y == 6 || (y == 3 && (x == 2 || x == 3)))
+			return 2;
+		return 1;
+	}
+	return 1;
+}
+
+/* 0 when left to the interpreter, 2 when it ends a block */
+static int
+kind(uint8_t op)
+{
+	int x, y;
+
+	switch(op){
+	case 0x27:	/* DAA */
+	case 0x76:	/* HLT */
+	case 0xd3:	/* OUT */
+	case 0xdb:	/* IN */
+	case 0xf3:	/* DI */
+	case 0xfb:	/* EI */
+		return 0;
+	}
+	if(op >> 6 != 3)
+		return 1;
+	x = (op >> 3) & 7;
+	y = op & 7;
+	if(y == 0 || y == 2 || y == 4 || y == 7)
+		return 2;
+	if(y == 1 && (x & 1) && x != 7)
+		return 2;
+	if(y == 3 && x < 2)
+		return 2;
+	if(y == 5 && (x & 1))
+		return 2;
+	return 1;
+}
+
+/*
+ * Flags an instruction defines and reads; returns whether the block
+ * may be left right after it, which needs every flag.
+ */
+static int
+flags(uint8_t op, int *def, int *use)
+{
+	int x, y;
+
+	x = (op >> 3) & 7;
+	y = op & 7;
+	*def = *use = 0;
+	switch(op >> 6){
+	case 0:
+		if(y == 1 && (x & 1))
+			*def = CY;
+		else if(y == 2 && !(x & 1))
+			return 1;
+		else if(y == 4 || y == 5){
+			*def = SZHP;
+			*use = CY;
+			return x == 6;
+		}else if(y == 6 && x == 6)
+			return 1;
+		else if(y == 7 && x != 4 && x != 5){
+			*def = CY;
+			*use = x == 2 || x == 3 || x == 7 ? CY : 0;
+		}
+		return 0;
+	case 1:
+		return x == 6;
+	case 2:
+		*def = ALL;
+		*use = x == 1 || x == 3 ? CY : 0;
+		return 0;
+	}
+	switch(y){
+	case 1:
+		if(x == 6)
+			*def = ALL;
+		return 0;
+	case 3:
+		return x == 4;
+	case 6:
+		*def = ALL;
+		*use = x == 1 || x == 3 ? CY : 0;
+		return 0;
+	}
+	*use = ALL;	/* conditions */
+	return 1;
+}
+
+static void
+alu(Jit *j, int x, int live)
+{
+	static const uint8_t opc[8] = {0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38};
+
+	ldb(j, EAX, RBX, j->reg[7]);
+	if(x == 1 || x == 3)
+		getcy(j);
+	if(x == 4 && live){	/* ANA: H is bit 3 of A|v */
+		E(0x88, 0xc2);	/* mov dl, al */
+		E(0x08, 0xca);	/* or dl, cl */
+		E(0x80, 0xe2, 0x08);	/* and dl, 8 */
+		E(0xd0, 0xe2);	/* shl dl, 1 */
+	}
+	E(opc[x], 0xc8);	/* op al, cl */
+	if(live){
+		E(0x9f);	/* lahf */
+		if(x == 2 || x == 3 || x == 7)
+			E(0x80, 0xf4, 0x10);	/* xor ah, 0x10: H is no borrow */
+		else if(x >= 4)
+			E(0x80, 0xe4, 0xef);	/* and ah, ~0x10 */
+		if(x == 4)
+			E(0x08, 0xd4);	/* or ah, dl */
+		stb(j, AH, RBP, J(f));
+	}
+	if(x != 7)
+		stb(j, EAX, RBX, j->reg[7]);
+}
+
+/* INR or DCR of al */
+static void
+incdec(Jit *j, int dec, int live)
+{
+	E(0xfe, dec ? 0xc8 : 0xc0);
+	if(!live)
+		return;
+	E(0x9f);
+	if(dec)
+		E(0x80, 0xf4, 0x10);
+	E(0x80, 0xe4, 0xfe);	/* and ah, ~1 */
+	ldb(j, EDX, RBP, J(f));
+	E(0x80, 0xe2, 0x01);	/* and dl, 1 */
+	E(0x08, 0xd4);
+	stb(j, AH, RBP, J(f));
+}
+
+/*
+ * Translate one instruction; cyc and n count the cycles and
+ * instructions of the block up to and including it.
+ */
+static void
+translate(Jit *j, Ins *in, uint32_t cyc, int n)
+{
+	static const uint8_t rot[4] = {0xc0, 0xc8, 0xd0, 0xd8};	/* rol ror rcl rcr al, 1 */
+	uint16_t next;
+	int x, y;
+
+	x = (in->op >> 3) & 7;
+	y = in->op & 7;
+	next = in->pc + in->len;
+	switch(in->op >> 6){
+	case 0:
+		switch(y){
+		case 0:	/* NOP */
+			break;
+		case 1:
+			if(x & 1){	/* DAD */
+				getrp(j, 2);
+				E(0x89, 0xc8);
+				getrp(j, x >> 1);
+				E(0x66, 0x01, 0xc8);	/* add ax, cx */
+				if(in->live)
+					setcy(j);
+				E(0x89, 0xc1);	/* mov ecx, eax */
+				putrp(j, 2);
+			}else if(x >> 1 == 3)	/* LXI */
+				movw(j, RBX, C(sp), in->imm);
+			else{
+				movb(j, RBX, j->reg[x], in->imm >> 8);
+				movb(j, RBX, j->reg[x + 1], in->imm);
+			}
+			break;
+		case 2:
+			switch(x){
+			case 0:	/* STAX */
+			case 2:
+				getrp(j, x >> 1);
+				ldb(j, EDX, RBX, j->reg[7]);
+				wr(j);
+				smc(j, next, cyc, n);
+				break;
+			case 1:	/* LDAX */
+			case 3:
+				getrp(j, x >> 1);
+				rd(j);
+				stb(j, EAX, RBX, j->reg[7]);
+				break;
+			case 4:	/* SHLD */
+				movi(j, ECX, in->imm);
+				ldb(j, EDX, RBX, j->reg[5]);
+				wr(j);
+				movi(j, ECX, (uint16_t)(in->imm + 1));
+				ldb(j, EDX, RBX, j->reg[4]);
+				wr(j);
+				smc(j, next, cyc, n);
+				break;
+			case 5:	/* LHLD */
+				movi(j, ECX, in->imm);
+				rd(j);
+				stb(j, EAX, RBX, j->reg[5]);
+				movi(j, ECX, (uint16_t)(in->imm + 1));
+				rd(j);
+				stb(j, EAX, RBX, j->reg[4]);
+				break;
+			case 6:	/* STA */
+				movi(j, ECX, in->imm);
+				ldb(j, EDX, RBX, j->reg[7]);
+				wr(j);
+				smc(j, next, cyc, n);
+				break;
+			case 7:	/* LDA */
+				movi(j, ECX, in->imm);
+				rd(j);
+				stb(j, EAX, RBX, j->reg[7]);
+				break;
+			}
+			break;
+		case 3:	/* INX, DCX */
+			if(x >> 1 == 3){
+				E(0x66, 0xff);
+				mem(j, x & 1, RBX, C(sp));
+			}else{
+				getrp(j, x >> 1);
+				E(0x66, 0xff, x & 1 ? 0xc9 : 0xc1);
+				putrp(j, x >> 1);
+			}
+			break;
+		case 4:	/* INR */
+		case 5:	/* DCR */
+			if(x == 6){
+				getrp(j, 2);
+				stw(j, ECX, RBP, J(tmp));
+				rd(j);
+				incdec(j, y == 5, in->live);
+				E(0x89, 0xc2);	/* mov edx, eax */
+				ldw(j, ECX, RBP, J(tmp));
+				wr(j);
+				smc(j, next, cyc, n);
+			}else{
+				ldb(j, EAX, RBX, j->reg[x]);
+				incdec(j, y == 5, in->live);
+				stb(j, EAX, RBX, j->reg[x]);
+			}
+			break;
+		case 6:	/* MVI */
+			if(x == 6){
+				getrp(j, 2);
+				movi(j, EDX, in->imm);
+				wr(j);
+				smc(j, next, cyc, n);
+			}else
+				movb(j, RBX, j->reg[x], in->imm);
+			break;
+		case 7:
+			switch(x){
+			case 0:	/* RLC, RRC, RAL, RAR */
+			case 1:
+			case 2:
+			case 3:
+				ldb(j, EAX, RBX, j->reg[7]);
+				if(x >= 2)
+					getcy(j);
+				E(0xd0, rot[x]);
+				if(in->live)
+					setcy(j);
+				stb(j, EAX, RBX, j->reg[7]);
+				break;
+			case 5:	/* CMA */
+				E(0xf6);
+				mem(j, 2, RBX, j->reg[7]);
+				break;
+			case 6:	/* STC */
+				opb(j, 1, RBP, J(f), 0x01);
+				break;
+			case 7:	/* CMC */
+				opb(j, 6, RBP, J(f), 0x01);
+				break;
+			}
+			break;
+		}
+		break;
+	case 1:	/* MOV */
+		if(x == 6){
+			getrp(j, 2);
+			ldb(j, EDX, RBX, j->reg[y]);
+			wr(j);
+			smc(j, next, cyc, n);
+		}else if(y == 6){
+			getrp(j, 2);
+			rd(j);
+			stb(j, EAX, RBX, j->reg[x]);
+		}else{
+			ldb(j, EAX, RBX, j->reg[y]);
+			stb(j, EAX, RBX, j->reg[x]);
+		}
+		break;
+	case 2:	/* ALU */
+		if(y == 6){
+			getrp(j, 2);
+			rd(j);
+			E(0x89, 0xc1);
+		}else
+			ldb(j, ECX, RBX, j->reg[y]);
+		alu(j, x, in->live);
+		break;
+	case 3:
+		switch(y){
+		case 0:	/* Rcc */
+			unless(j, x, next, cyc, n);
+			pop(j);
+			ldw(j, EAX, RBP, J(tmp));
+			stw(j, EAX, RBX, C(pc));
+			E(0xe9);
+			toexit(j, EXIT_DYN, 0, cyc + 6, n);
+			break;
+		case 1:
+			if(x == 1 || x == 3){	/* RET */
+				pop(j);
+				ldw(j, EAX, RBP, J(tmp));
+				stw(j, EAX, RBX, C(pc));
+				E(0xe9);
+				toexit(j, EXIT_DYN, 0, cyc, n);
+			}else if(x == 5){	/* PCHL */
+				getrp(j, 2);
+				stw(j, ECX, RBX, C(pc));
+				E(0xe9);
+				toexit(j, EXIT_DYN, 0, cyc, n);
+			}else if(x == 7){	/* SPHL */
+				getrp(j, 2);
+				stw(j, ECX, RBX, C(sp));
+			}else if(x == 6){	/* POP PSW */
+				pop(j);
+				ldb(j, EAX, RBP, J(tmp));
+				E(0x24, 0xd5);	/* and al, 0xd5 */
+				E(0x0c, 0x02);	/* or al, 2 */
+				stb(j, EAX, RBP, J(f));
+				ldb(j, EAX, RBP, J(tmp) + 1);
+				stb(j, EAX, RBX, j->reg[7]);
+			}else{	/* POP */
+				pop(j);
+				ldw(j, ECX, RBP, J(tmp));
+				putrp(j, x >> 1);
+			}
+			break;
+		case 2:	/* Jcc */
+			unless(j, x, next, cyc, n);
+			E(0xe9);
+			toexit(j, EXIT_LINK, in->imm, cyc, n);
+			break;
+		case 3:
+			switch(x){
+			case 0:	/* JMP */
+			case 1:
+				E(0xe9);
+				toexit(j, EXIT_LINK, in->imm, cyc, n);
+				break;
+			case 4:	/* XTHL */
+				pop(j);
+				E(0x66, 0x83);	/* sub word [rbx+sp], 2 */
+				mem(j, 5, RBX, C(sp));
+				E(0x02);
+				ldw(j, ECX, RBX, C(sp));
+				ldb(j, EDX, RBX, j->reg[5]);
+				wr(j);
+				ldw(j, ECX, RBX, C(sp));
+				E(0x66, 0xff, 0xc1);
+				ldb(j, EDX, RBX, j->reg[4]);
+				wr(j);
+				ldb(j, EAX, RBP, J(tmp));
+				stb(j, EAX, RBX, j->reg[5]);
+				ldb(j, EAX, RBP, J(tmp) + 1);
+				stb(j, EAX, RBX, j->reg[4]);
+				smc(j, next, cyc, n);
+				break;
+			case 5:	/* XCHG */
+				ldw(j, EAX, RBX, j->reg[2]);
+				ldw(j, ECX, RBX, j->reg[4]);
+				stw(j, ECX, RBX, j->reg[2]);
+				stw(j, EAX, RBX, j->reg[4]);
+				break;
+			}
+			break;
+		case 4:	/* Ccc */
+			unless(j, x, next, cyc, n);
+			push(j, 1, next);
+			smc(j, in->imm, cyc + 6, n);
+			E(0xe9);
+			toexit(j, EXIT_LINK, in->imm, cyc + 6, n);
+			break;
+		case 5:
+			if(x & 1){	/* CALL */
+				push(j, 1, next);
+				smc(j, in->imm, cyc, n);
+				E(0xe9);
+				toexit(j, EXIT_LINK, in->imm, cyc, n);
+			}else if(x == 6){	/* PUSH PSW */
+				ldb(j, ECX, RBP, J(f));
+				ldb(j, EAX, RBX, j->reg[7]);
+				E(0x88, 0xc5);	/* mov ch, al */
+				push(j, 0, 0);
+				smc(j, next, cyc, n);
+			}else{	/* PUSH */
+				getrp(j, x >> 1);
+				push(j, 0, 0);
+				smc(j, next, cyc, n);
+			}
+			break;
+		case 6:	/* ALU imm */
+			movi(j, ECX, in->imm);
+			alu(j, x, in->live);
+			break;
+		case 7:	/* RST */
+			push(j, 1, next);
+			smc(j, x << 3, cyc, n);
+			E(0xe9);
+			toexit(j, EXIT_LINK, x << 3, cyc, n);
+			break;
+		}
+		break;
+	}
+}
+
+static void
+flush(Jit *j)
+{
+	int i;
+
+	j->p = j->base;
+	j->nblk = 0;
+	j->nlink = 0;
+	for(i = 0; i < 17; i++)
+		if(j->tab[i])
+			memset(j->tab[i], 0, 0x4000 * sizeof(Block *));
+	memset(j->hascode, 0, sizeof(j->hascode));
+	j->gen++;
+	j->nflush++;
+}
+
+static Block *
+compile(Jit *j, uint16_t pc, int bank, uint8_t *page)
+{
+	Ins ins[MAX_INS];
+	Block *b;
+	Exit *x;
+	Link *l;
+	uint32_t off, cyc;
+	int i, n, k, def, use, live;
+
+	if(j->p + CODE_SLACK > j->code + CODE_SIZE || j->nblk == MAX_BLOCKS || j->nlink + 3 * MAX_INS > MAX_LINKS)
+		flush(j);
+
+	/* decode up to the end of the block or the page */
+	off = pc & 0x3fff;
+	for(n = 0; n < MAX_INS; n++){
+		ins[n].op = page[off];
+		ins[n].len = oplen(ins[n].op);
+		ins[n].pc = pc;
+		k = kind(ins[n].op);
+		if(k == 0 || (off & 0xff) + ins[n].len > 256)
+			break;
+		ins[n].imm = 0;
+		if(ins[n].len == 2)
+			ins[n].imm = page[off + 1];
+		else if(ins[n].len == 3)
+			ins[n].imm = page[off + 1] | page[off + 2] << 8;
+		off += ins[n].len;
+		pc += ins[n].len;
+		if(k == 2 || (off & 0xff) == 0){
+			n++;
+			break;
+		}
+	}
+	if(n == 0)
+		return NULL;
+
+	live = ALL;
+	for(i = n - 1; i >= 0; i--){
+		if(flags(ins[i].op, &def, &use))
+			live = ALL;
+		ins[i].live = live & def;
+		live = (live & ~def) | use;
+	}
+
+	b = &j->blk[j->nblk++];
+	b->pc = ins[0].pc;
+	b->bank = bank;
+	b->fit = 0;
+	for(i = 0; i < n - 1; i++)
+		b->fit += dc_cycles[ins[i].op];
+
+	b->chain = j->p;
+	E(0x48, 0x8b);	/* mov rax, [rbx+cyc] */
+	mem(j, EAX, RBX, C(cyc));
+	E(0x48, 0x05);	/* add rax, fit */
+	e32(j, b->fit);
+	E(0x48, 0x3b);	/* cmp rax, [rbp+stop] */
+	mem(j, EAX, RBP, J(stop));
+	E(0x0f, 0x82);	/* jb body */
+	e32(j, 7);
+	E(0x31, 0xc0);	/* xor eax, eax */
+	jmp(j, j->epilogue);
+
+	b->body = j->p;
+	j->nexit = 0;
+	cyc = 0;
+	for(i = 0; i < n; i++){
+		cyc += dc_cycles[ins[i].op];
+		translate(j, &ins[i], cyc, i + 1);
+	}
+	if(kind(ins[n - 1].op) != 2){
+		E(0xe9);
+		toexit(j, EXIT_LINK, pc, cyc, n);
+	}
+
+	for(i = 0; i < j->nexit; i++){
+		x = &j->exit[i];
+		rel32(x->site, j->p);
+		E(0x48, 0x81);	/* add qword [rbx+cyc], imm32 */
+		mem(j, 0, RBX, C(cyc));
+		e32(j, x->cyc);
+		E(0x48, 0x83);	/* add qword [rbp+insns], imm8 */
+		mem(j, 0, RBP, J(insns));
+		E(x->n);
+		if(x->kind != EXIT_DYN)
+			movw(j, RBX, C(pc), x->pc);
+		if(x->kind == EXIT_LINK){
+			l = &j->link[j->nlink++];
+			l->from = b;
+			l->to = x->pc;
+			E(0xe9);	/* patched to chain */
+			e32(j, 0);
+			l->site = j->p - 4;
+			E(0x48, 0xb8);	/* mov rax, link */
+			e64(j, (uintptr_t)l);
+		}else
+			E(0x31, 0xc0);
+		jmp(j, j->epilogue);
+	}
+	j->nblocks++;
+	return b;
+}
+
+static Block *
+lookup(Jit *j, uint16_t pc)
+{
+	uint8_t *page;
+	uint32_t off;
+	Block **t, *b;
+	int bank;
+
+	page = j->map[pc >> 14];
+	off = pc & 0x3fff;
+	if(page == j->rom)
+		bank = 16;
+	else{
+		bank = (page - j->ram) >> 14;
+		if(j->ban[(bank << 6) | off >> 8] >= BAN)
+			return NULL;
+	}
+	t = j->tab[bank];
+	if(t == NULL && (t = j->tab[bank] = calloc(0x4000, sizeof(Block *))) == NULL)
+		return NULL;
+	b = t[off];
+	if(b == &j->none)
+		return NULL;
+	if(b && b->pc == pc)
+		return b;
+	b = compile(j, pc, bank, page);
+	t[off] = b ? b : &j->none;
+	if(bank < 16)
+		j->hascode[(bank << 6) | off >> 8] = 1;
+	return b;
+}
+
+Jit *
+jit_new(i8080 *cpu, DCache *dc, uint8_t **map, uint8_t *rom, uint8_t *ram, int diff)
+{
+	Jit *j;
+
+	/* the generated code relies on this layout */
+	if(sizeof(cpu->cyc) != 8 || C(l) >= 128 || C(c) != C(b) + 1 || C(e) != C(d) + 1 || C(l) != C(h) + 1 ||
+	   J(map) >= 128){
+		errno = ENOTSUP;
+		return NULL;
+	}
+	j = calloc(1, sizeof(Jit));
+	if(j == NULL)
+		return NULL;
+	j->blk = calloc(MAX_BLOCKS, sizeof(Block));
+	j->link = calloc(MAX_LINKS, sizeof(Link));
+	j->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(j->blk == NULL || j->link == NULL || j->code == MAP_FAILED){
+		if(j->code != MAP_FAILED)
+			munmap(j->code, CODE_SIZE);
+		free(j->blk);
+		free(j->link);
+		free(j);
+		return NULL;
+	}
+	j->cpu = cpu;
+	j->dc = dc;
+	j->map = map;
+	j->rom = rom;
+	j->ram = ram;
+	j->diff = diff;
+	j->reg[0] = C(b);
+	j->reg[1] = C(c);
+	j->reg[2] = C(d);
+	j->reg[3] = C(e);
+	j->reg[4] = C(h);
+	j->reg[5] = C(l);
+	j->reg[7] = C(a);
+
+	/* enter(cpu, jit, code) and the way back */
+	j->p = j->code;
+	E(0x53, 0x55);	/* push rbx; push rbp */
+	E(0x48, 0x83, 0xec, 0x08);	/* sub rsp, 8 */
+	E(0x48, 0x89, 0xfb);	/* mov rbx, rdi */
+	E(0x48, 0x89, 0xf5);	/* mov rbp, rsi */
+	E(0xff, 0xe2);	/* jmp rdx */
+	j->epilogue = j->p;
+	E(0x48, 0x83, 0xc4, 0x08);	/* add rsp, 8 */
+	E(0x5d, 0x5b, 0xc3);	/* pop rbp; pop rbx; ret */
+	*(void **)&j->enter = j->code;
+	j->base = j->p;
+	return j;
+}
+
+void
+jit_free(Jit *j)
+{
+	int i;
+
+	for(i = 0; i < 17; i++)
+		free(j->tab[i]);
+	munmap(j->code, CODE_SIZE);
+	free(j->blk);
+	free(j->link);
+	free(j);
+}
+
+/* byte addr of RAM is about to be written */
+void
+jit_write(Jit *j, uint32_t addr)
+{
+	if(j->logging && j->nlog < LOG_MAX){
+		j->log[j->nlog].addr = addr;
+		j->log[j->nlog].old = j->ram[addr];
+		j->nlog++;
+	}
+	if(j->hascode[addr >> 8]){
+		if(j->ban[addr >> 8] < BAN)
+			j->ban[addr >> 8]++;
+		flush(j);
+		j->smc = 1;
+	}
+}
+
+/* RAM was replaced behind our back */
+void
+jit_flush(Jit *j)
+{
+	flush(j);
+}
+
+/* the page at addr was put back as it was: not self-modifying code */
+void
+jit_restore(Jit *j, uint32_t addr)
+{
+	if(j->hascode[addr >> 8])
+		flush(j);
+}
+
+static uint8_t
+packf(i8080 *c)
+{
+	return c->sf << 7 | c->zf << 6 | c->hf << 4 | c->pf << 2 | 1 << 1 | c->cf;
+}
+
+static void
+unpackf(i8080 *c, uint8_t f)
+{
+	c->sf = f >> 7;
+	c->zf = (f >> 6) & 1;
+	c->hf = (f >> 4) & 1;
+	c->pf = (f >> 2) & 1;
+	c->cf = f & 1;
+}
+
+static int
+samecpu(i8080 *a, i8080 *b)
+{
+	return a->cyc == b->cyc && a->pc == b->pc && a->sp == b->sp &&
+		a->a == b->a && a->b == b->b && a->c == b->c && a->d == b->d &&
+		a->e == b->e && a->h == b->h && a->l == b->l && packf(a) == packf(b);
+}
+
+static void
+dump(char *what, i8080 *c)
+{
+	fprintf(stderr, "%s: pc %04x sp %04x a %02x bc %02x%02x de %02x%02x hl %02x%02x f %02x cyc %lu\n",
+		what, c->pc, c->sp, c->a, c->b, c->c, c->d, c->e, c->h, c->l, packf(c), (unsigned long)c->cyc);
+}
+
+/* run block b natively; returns the exit link, if any */
+static Link *
+native(Jit *j, Block *b)
+{
+	Link *l;
+
+	j->f = packf(j->cpu);
+	j->smc = 0;
+	j->insns = 0;
+	l = (Link *)j->enter(j->cpu, j, b->body);
+	unpackf(j->cpu, j->f);
+	j->ninsns += j->insns;
+	return l;
+}
+
+/*
+ * Differential mode: run each block natively, undo its writes, run
+ * it again in the interpreter and compare registers, flags, cycles
+ * and every byte either of them wrote.
+ */
+static unsigned long
+differ(Jit *j, Block *b, uint8_t *irq, uint8_t mask)
+{
+	i8080 before, after;
+	uint8_t val[LOG_MAX];
+	uint64_t end, insns;
+	unsigned long n;
+	int i, k, nat, bad;
+
+	before = *j->cpu;
+	j->logging = 1;
+	j->nlog = 0;
+	native(j, b);
+	after = *j->cpu;
+	insns = j->insns;
+	nat = j->nlog;
+	for(i = 0; i < nat; i++)
+		val[i] = j->ram[j->log[i].addr];
+	for(i = nat - 1; i >= 0; i--)
+		j->ram[j->log[i].addr] = j->log[i].old;
+
+	*j->cpu = before;
+	end = after.cyc;
+	n = dc_run(j->dc, &end, irq, mask);
+	j->logging = 0;
+
+	bad = !samecpu(j->cpu, &after) || n != insns;
+	for(i = 0; i < j->nlog && !bad; i++){
+		for(k = nat - 1; k >= 0 && j->log[k].addr != j->log[i].addr; k--)
+			;
+		if(k >= 0)
+			bad = j->ram[j->log[i].addr] != val[k];
+		else if(i >= nat){
+			for(k = nat; j->log[k].addr != j->log[i].addr; k++)
+				;
+			bad = j->ram[j->log[i].addr] != j->log[k].old;
+		}
+	}
+	if(bad){
+		fprintf(stderr, "jit: block at %04x differs from the interpreter\n", b->pc);
+		dump("before", &before);
+		dump("native", &after);
+		dump("interp", j->cpu);
+		for(i = 0; i < j->nlog; i++)
+			fprintf(stderr, "%s write %05x\n", i < nat ? "native" : "interp", j->log[i].addr);
+		abort();
+	}
+	return n;
+}
+
+/*
+ * Run until the cycle count reaches *stop or the CPU halts, as
+ * dc_run() does: translated blocks where they fit, the interpreter
+ * for everything else.
+ */
+unsigned long
+jit_run(Jit *j, uint64_t *stop, uint8_t *irq, uint8_t mask)
+{
+	i8080 *c;
+	unsigned long n;
+	uint64_t one;
+	unsigned gen;
+	Block *b, *t;
+	Link *l;
+
+	c = j->cpu;
+	n = 0;
+	while(c->cyc < *stop){
+		b = NULL;
+		if(!c->halted && c->interrupt_delay == 0 && !(c->iff && ((*irq & mask) || c->interrupt_pending)))
+			b = lookup(j, c->pc);
+		if(b == NULL || c->cyc + b->fit >= *stop){
+			one = c->cyc + 1;
+			n += dc_run(j->dc, &one, irq, mask);
+			if(c->halted)
+				break;
+			continue;
+		}
+		j->stop = *stop;
+		if(j->diff){
+			n += differ(j, b, irq, mask);
+			continue;
+		}
+		l = native(j, b);
+		n += j->insns;
+		if(l == NULL || (l->to >> 14) != (l->from->pc >> 14))
+			continue;
+		gen = j->gen;
+		t = lookup(j, l->to);
+		if(t && gen == j->gen && t->bank == l->from->bank)
+			rel32(l->site, t->chain);
+	}
+	return n;
+}
+
+void
+jit_report(Jit *j, char *buf, size_t len)
+{
+	snprintf(buf, len, "jit: %llu blocks translated, %llu flushes, %llu instructions run natively",
+		(unsigned long long)j->nblocks, (unsigned long long)j->nflush, (unsigned long long)j->ninsns);
+}
+
+#else
+
+Jit *
+jit_new(i8080 *cpu, DCache *dc, uint8_t **map, uint8_t *rom, uint8_t *ram, int diff)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void
+jit_free(Jit *j)
+{
+}
+
+void
+jit_write(Jit *j, uint32_t addr)
+{
+}
+
+void
+jit_flush(Jit *j)
+{
+}
+
+void
+jit_restore(Jit *j, uint32_t addr)
+{
+}
+
+unsigned long
+jit_run(Jit *j, uint64_t *stop, uint8_t *irq, uint8_t mask)
+{
+	return 0;
+}
+
+void
+jit_report(Jit *j, char *buf, size_t len)
+{
+	snprintf(buf, len, "jit: not available");
+}
+
+#endif
@@ -0,0 +1,9 @@
+typedef struct Jit Jit;
+
+Jit *jit_new(i8080 *cpu, DCache *dc, uint8_t **map, uint8_t *rom, uint8_t *ram, int diff);
+void jit_free(Jit *j);
+void jit_write(Jit *j, uint32_t addr);
+void jit_flush(Jit *j);
+void jit_restore(Jit *j, uint32_t addr);
+unsigned long jit_run(Jit *j, uint64_t *stop, uint8_t *irq, uint8_t mask);
+void jit_report(Jit *j, char *buf, size_t len);
@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "trace.h"
+
+/*
+ * Offline reader of pac80emu -T traces: prints a cycle range, finds
+ * instructions and accesses, compares two traces up to their first
+ * difference and gives the registers at a cycle.
+ */
+typedef struct Reader Reader;
+struct Reader{
+	gzFile gz;
+	char *path;
+	unsigned long long n;
+	uint8_t buf[4096 * TRACE_LEN];
+	int len;
+	int pos;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: p80trace dump trace [from [to]]\n");
+	fprintf(stderr, "       p80trace find trace pc|op|write|in|out hex [value]\n");
+	fprintf(stderr, "       p80trace diff trace1 trace2\n");
+	fprintf(stderr, "       p80trace regs trace cycle\n");
+	exit(2);
+}
+
+static void
+ropen(Reader *r, char *path)
+{
+	char magic[8];
+
+	r->path = path;
+	r->gz = gzopen(path, "rb");
+	if(r->gz == NULL){
+		perror(path);
+		exit(2);
+	}
+	if(gzread(r->gz, magic, 8) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0){
+		fprintf(stderr, "%s: not a trace\n", path);
+		exit(2);
+	}
+	r->n = 0;
+	r->len = r->pos = 0;
+}
+
+/* the next record, 0 at the end */
+static int
+rnext(Reader *r, TraceRec *t)
+{
+	if(r->pos + TRACE_LEN > r->len){
+		r->len = gzread(r->gz, r->buf, sizeof(r->buf));
+		r->pos = 0;
+		if(r->len < 0){
+			fprintf(stderr, "%s: read error\n", r->path);
+			exit(2);
+		}
+		if(r->len < TRACE_LEN)
+			return 0;
+	}
+	trace_unpack(r->buf + r->pos, t);
+	r->pos += TRACE_LEN;
+	r->n++;
+	return 1;
+}
+
+static void
+show(TraceRec *t)
+{
+	static char *kinds[] = {
+		[TR_IRQ] = "IRQ",
+		[TR_WRITE] = "W",
+		[TR_IN] = "IN",
+		[TR_OUT] = "OUT",
+	};
+
+	if(t->kind == TR_INSN){
+		printf("%12llu %X%X%X%X:%04X %02X  A=%02X F=%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X SP=%04X\n",
+			(unsigned long long)t->cyc, t->banks & 0xf, t->banks >> 4 & 0xf, t->banks >> 8 & 0xf,
+			t->banks >> 12, t->addr, t->val, t->r[7], t->r[6], t->r[0], t->r[1], t->r[2], t->r[3],
+			t->r[4], t->r[5], t->sp);
+	}else if(t->kind == TR_IRQ)
+		printf("%12llu %s\n", (unsigned long long)t->cyc, kinds[t->kind]);
+	else if(t->kind <= TR_OUT)
+		printf("%12llu %9s %04X=%02X\n", (unsigned long long)t->cyc, kinds[t->kind], t->addr, t->val);
+	else
+		printf("%12llu ? %d\n", (unsigned long long)t->cyc, t->kind);
+}
+
+static int
+dump(char *path, unsigned long long from, unsigned long long to)
+{
+	Reader r;
+	TraceRec t;
+
+	ropen(&r, path);
+	while(rnext(&r, &t) && t.cyc <= to)
+		if(t.cyc >= from)
+			show(&t);
+	return 0;
+}
+
+static int
+find(char *path, char *what, unsigned long addr, long val)
+{
+	static char *names[] = {"pc", "op", "write", "in", "out"};
+	static uint8_t kinds[] = {TR_INSN, TR_INSN, TR_WRITE, TR_IN, TR_OUT};
+	Reader r;
+	TraceRec t;
+	unsigned long long hits;
+	int i;
+
+	for(i = 0; i < 5 && strcmp(what, names[i]) != 0; i++)
+		;
+	if(i == 5)
+		usage();
+	ropen(&r, path);
+	hits = 0;
+	while(rnext(&r, &t)){
+		if(t.kind != kinds[i])
+			continue;
+		if(i == 1 ? t.val != addr : t.addr != addr || (val >= 0 && t.val != val))
+			continue;
+		show(&t);
+		hits++;
+	}
+	return hits == 0;
+}
+
+/* the first record that differs, after the few leading to it */
+static int
+diff(char *path1, char *path2)
+{
+	static Reader a, b;
+	TraceRec x, y, last[4];
+	uint8_t p[TRACE_LEN], q[TRACE_LEN];
+	unsigned long long same, k;
+	int more1, more2;
+
+	ropen(&a, path1);
+	ropen(&b, path2);
+	same = 0;
+	for(;;){
+		more1 = rnext(&a, &x);
+		more2 = rnext(&b, &y);
+		if(!more1 || !more2)
+			break;
+		trace_pack(&x, p);
+		trace_pack(&y, q);
+		if(memcmp(p, q, TRACE_LEN) != 0)
+			break;
+		last[same++ % 4] = x;
+	}
+	if(!more1 && !more2){
+		printf("same %llu records\n", same);
+		return 0;
+	}
+	for(k = same > 3 ? same - 3 : 0; k < same; k++)
+		show(&last[k % 4]);
+	if(more1){
+		printf("< ");
+		show(&x);
+	}else
+		printf("< end of %s\n", path1);
+	if(more2){
+		printf("> ");
+		show(&y);
+	}else
+		printf("> end of %s\n", path2);
+	return 1;
+}
+
+/* registers as the first instruction at or after cycle starts */
+static int
+regs(char *path, unsigned long long cycle)
+{
+	Reader r;
+	TraceRec t;
+
+	ropen(&r, path);
+	while(rnext(&r, &t))
+		if(t.kind == TR_INSN && t.cyc >= cycle){
+			show(&t);
+			return 0;
+		}
+	fprintf(stderr, "no instruction at or after cycle %llu\n", cycle);
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if(argc < 3)
+		usage();
+	if(strcmp(argv[1], "dump") == 0 && argc <= 5)
+		return dump(argv[2], argc > 3 ? strtoull(argv[3], NULL, 0) : 0,
+			argc > 4 ? strtoull(argv[4], NULL, 0) : ~0ULL);
+	if(strcmp(argv[1], "find") == 0 && (argc == 5 || argc == 6))
+		return find(argv[2], argv[3], strtoul(argv[4], NULL, 16),
+			argc > 5 ? strtol(argv[5], NULL, 16) : -1);
+	if(strcmp(argv[1], "diff") == 0 && argc == 4)
+		return diff(argv[2], argv[3]);
+	if(strcmp(argv[1], "regs") == 0 && argc == 4)
+		return regs(argv[2], strtoull(argv[3], NULL, 0));
+	usage();
+	return 2;
+}
@@ -1,19 +1,39 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <SDL2/SDL.h>
+#include <zlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "8080/i8080.h"
 #include "emu76489/emu76489.h"
+#include "cf.h"
+#include "dcache.h"
+#include "jit.h"
+#include "pool.h"
+#include "prof.h"
+#include "trace.h"
 
 #define VA15  (1 << 0)
 #define VINTE (1 << 1)
@@ -33,6 +53,12 @@
 #define AB    (1 << 4)
 #define STRTC (1 << 5)
 #define SEL   (1 << 6)
+#define HBUSY (1 << 0)
+#define HDONE (1 << 1)
+#define HEOF  (1 << 2)
+#define HERR  (1 << 7)
+#define HIE   (1 << 0)
+#define HINT  (1 << 0)	/* in ext_irq */
 
 #define BUTTON_U (1 << 0)
 #define BUTTON_D (1 << 1)
@@ -47,6 +73,59 @@
 #define BUTTON_X (1 << 10)
 #define BUTTON_M (1 << 11)
 
+#define CPU_HZ      3146875
+#define FRAME       (CPU_HZ / 60)
+#define KBD_CYCLES  (CPU_HZ / 1000)	/* one scancode per ms */
+#define JS_TIMEOUT  5035	/* 1.6 ms */
+#define UART_RING   16384	/* host side buffer, each way */
+#define IDLE_MAX    1024	/* longest status polling loop detected */
+#define NEVER       UINT64_MAX
+#define SINK        (256 * 1024)	/* RAM offset of a bank taking writes to the ROM */
+
+#define DIRTY_VIDEO (1 << 0)
+#define DIRTY_SNAP  (1 << 1)
+#define DIRTY_REWIND (1 << 2)
+#define DIRTY_CODE  (1 << 3)
+#define DIRTY_AHEAD (1 << 4)
+
+#define SNAP_MAGIC   "P80SNAP\n"
+#define SNAP_VERSION 1
+
+#define INPUT_MAGIC "P80INP1\n"
+#define INPUT_LEN   16	/* bytes a record */
+
+#define REWIND_MAX 36000	/* frames, ten minutes */
+#define REWIND_REC (4096 + 1024 * (4 + 386))	/* largest record: state, then alternate bytes changed on every page */
+
+#define AHEAD_MAX 30	/* frames, half a second */
+
+#define AUDIO_SIZE    4096	/* samples, 93 ms at 44.1 kHz */
+#define AUDIO_PREFILL 1024
+
+enum{
+	ENGINE_PLAIN,
+	ENGINE_CACHE,
+	ENGINE_JIT,
+	ENGINE_DIFF,	/* JIT checked against the cache */
+};
+
+enum{
+	IN_KBD,	/* a scancode */
+	IN_JS,	/* new joystick buttons */
+	IN_UART,	/* a received byte */
+	IN_RESET,
+	IN_END,	/* the CRC of RAM when recording stopped */
+};
+
+enum{
+	EV_VINT,
+	EV_KBD,
+	EV_JS,
+	EV_UART_TX,
+	EV_UART_RX,
+	NEV
+};
+
 typedef struct FIFO FIFO;
 struct FIFO{
 	uint8_t buf[256];
@@ -55,31 +134,286 @@ struct FIFO{
 	uint8_t s;
 };
 
+/*
+ * Host side of the serial line, outside snapshots: received bytes wait
+ * here for room in the UART FIFO, transmitted ones for the host to
+ * take them, so the host is read and written in batches.
+ */
+typedef struct Ring Ring;
+struct Ring{
+	uint8_t buf[UART_RING];
+	uint32_t head;
+	uint32_t tail;
+};
+
+typedef struct Input Input;
+struct Input{
+	uint64_t cyc;
+	uint32_t val;
+	uint8_t kind;
+};
+
+/*
+ * PSG output rendered by the CPU loop up to the current cycle before
+ * every PSG write and at the end of every batch, passed lock-free to
+ * the audio callback, which only copies it out.
+ */
+typedef struct Audio Audio;
+struct Audio{
+	int16_t buf[AUDIO_SIZE];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	uint64_t pos;	/* cycle of the next sample, 16.16 */
+	uint64_t rate;	/* cycles per sample, 16.16 */
+	unsigned long overruns;
+	SDL_atomic_t underruns;
+	int fill;	/* callback waits for AUDIO_PREFILL samples */
+	int16_t last;
+};
+
+typedef struct Rewind Rewind;
+struct Rewind{
+	uint8_t *buf;
+	size_t size;
+	size_t used;
+	struct{
+		size_t off;
+		size_t len;
+		uint64_t cyc;
+	} rec[REWIND_MAX];
+	int first;
+	int n;
+	uint8_t ram[256 * 1024];	/* RAM at the newest frame */
+	uint8_t *scratch;
+	uint64_t frames;
+	uint64_t ns;	/* time spent capturing */
+	uint64_t maxns;
+};
+
+typedef struct Ahead Ahead;
+struct Ahead{
+	int frames;
+	uint8_t ram[256 * 1024];	/* RAM at the last real frame */
+	uint8_t state[4096];
+	uint32_t tx;	/* host rings */
+	uint32_t rx;
+	size_t prompt_at;
+	uint64_t idle_skip;
+	Audio *audio;
+	Prof *prof;
+	Trace *trace;
+	uint64_t t0;
+	uint64_t n;
+	uint64_t ns;	/* time spent saving, running ahead and restoring */
+	uint64_t maxns;
+	unsigned long held;	/* OUTs held back */
+};
+
+/*
+ * Latency of a key press: from the SDL event, through the guest reading
+ * the scancode from port A, to the next frame presented. The totals
+ * from n to maxshown belong to the presenting thread, the rest to the
+ * machine's.
+ */
+typedef struct Latency Latency;
+struct Latency{
+	int state;	/* 0 idle, 1 pushed, 2 in port A, 3 read */
+	uint8_t code;
+	uint64_t t0;
+	uint64_t t1;
+	uint64_t cyc;
+	uint64_t cycles;
+	unsigned long n;
+	uint64_t read;	/* totals, ns */
+	uint64_t shown;
+	uint64_t maxshown;
+};
+
+/* a key read, handed with the frame it first shows in */
+typedef struct KeyRead KeyRead;
+struct KeyRead{
+	int read;
+	uint8_t code;
+	uint64_t t0;
+	uint64_t t1;
+};
+
 typedef struct Machine Machine;
 struct Machine{
+	i8080 cpu;
+	DCache *dc;
+	Jit *jit;
+	uint64_t ev[NEV];
+	uint64_t next;
+	uint64_t stop;
+	uint64_t frame;
+	int idle_pc;
+	unsigned idle_writes;
+	uint64_t idle_cyc;
+	uint64_t idle_skip;
+	uint8_t idle_ppi_c;
+	i8080 idle_cpu;
 	uint8_t *ram;
 	uint8_t *rom;
 	uint8_t *map[4];
+	uint16_t banks;	/* page at each slot, a nibble each */
+	uint32_t wmap[4];	/* RAM offset written through each slot */
+	unsigned writes;
 	uint8_t uart_rx;
 	uint8_t uart_tx;
 	uint8_t uart_status;
+	uint64_t uart_rxt;
+	uint64_t uart_cycles;	/* one character at the line rate */
+	int uart_fd;
+	int uart_lfd;	/* listening socket, or -1 on a pty */
+	int uart_eof;
 	FIFO uart_fifo;
+	Ring uart_in;
+	Ring uart_out;
+	char *prompt;	/* output awaited by the fork server */
+	size_t prompt_at;
 	uint16_t cf_scount;
 	uint16_t cf_bcount;
 	uint32_t cf_lba;
 	uint8_t cf_status;
-	uint8_t *cf_data;
+	uint8_t cf_cmd;
+	uint8_t *cf_buf;
+	uint64_t cf_insns;
+	CF *cf;
 	off_t cf_size;
 	uint8_t ppi_a;
 	uint8_t ppi_b;
 	uint8_t ppi_c;
+	uint8_t ext_irq;	/* EXT devices sharing the UART interrupt line */
 	FIFO kb_fifo;
 	SNG *sng;
+	Audio *audio;
+	int snap_base;	/* saved or loaded: later saves may be incremental */
+	Rewind *rewind;
+	Ahead *ahead;
+	int speculative;	/* running ahead: nothing leaves the machine */
+	Latency *lat;
+	Prof *prof;	/* NULL unless profiling */
+	char *prof_path;
+	Trace *trace;	/* NULL unless tracing */
+	FILE *rec;	/* inputs being recorded */
+	uint16_t rec_js;
+	Input *play;	/* inputs being replayed */
+	size_t nplay;
+	size_t played;
+	unsigned long late;	/* replayed after their cycle */
+	int host_fd;
+	char host_name[64];
+	uint8_t host_len;
+	uint16_t host_addr;
+	uint16_t host_count;
+	uint8_t host_status;
+	uint8_t host_ctrl;
 	uint16_t js_buttons;
 	uint8_t js_state;
-	uint8_t js_timer;
+	uint8_t dirty[(SINK + 0x4000) / 256];
 };
 
+/*
+ * With SDL the machine runs on a thread of its own and the main thread
+ * only takes events and presents frames, so neither a slow present nor
+ * a dialog holds the CPU back. Input reaches the machine through a
+ * single-producer ring of commands. Frames come back through three
+ * buffers: the one the machine draws, the one on screen and the latest
+ * finished, which each side swaps for its own with an atomic exchange.
+ */
+#define CMD_SIZE 256
+#define FRESH    4	/* in latest: not taken yet */
+
+enum{
+	CMD_KEY,	/* val is the code, t when it went down or 0 */
+	CMD_JS,	/* val is the buttons held */
+	CMD_REWIND,	/* val is 1 to start */
+	CMD_RESET,
+	CMD_SAVE,
+	CMD_QUIT,
+};
+
+typedef struct Cmd Cmd;
+struct Cmd{
+	uint8_t op;
+	uint16_t val;
+	uint64_t t;
+};
+
+typedef struct Frame Frame;
+struct Frame{
+	uint32_t px[320 * 240];
+	KeyRead key;
+};
+
+typedef struct Screen Screen;
+struct Screen{
+	Machine *m;
+	Cmd cmd[CMD_SIZE];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	Frame frame[3];
+	SDL_atomic_t latest;
+	int back;	/* the machine's buffer */
+	uint64_t cols[3];	/* columns each buffer has yet to draw, a bit each */
+	uint32_t shown;	/* plane base of the last frame */
+	KeyRead key;	/* waiting for a frame */
+	uint32_t pal[4];
+	Uint32 event;	/* SDL event type of a fresh frame */
+	char *save;
+	int incremental;
+	pthread_t thread;
+};
+
+/*
+ * Port I/O goes through a bus of devices, one per select decoded from
+ * A3-A5. Each device picks its register out of the port with shift and
+ * mask; the bus table holds the handlers and register of every port,
+ * so an access is one indexed call. EXT0-EXT2 are empty slots a new
+ * device plugs into with attach(). Devices without a snapshot tag keep
+ * their state in the MACH chunk, in attach order.
+ */
+typedef struct Device Device;
+struct Device{
+	char *name;
+	uint8_t sel;	/* port & 0x38 */
+	uint8_t shift;
+	uint8_t mask;
+	uint8_t idle;	/* registers polled in idle loops, a bit each */
+	uint8_t (*in)(Machine *m, uint8_t port, uint8_t reg);
+	void (*out)(Machine *m, uint8_t port, uint8_t reg, uint8_t val);
+	void (*reset)(Machine *m);
+	char *tag;
+	uint8_t *(*snap)(Machine *m, uint8_t *p, int load);
+	uint8_t outside;	/* writes reach beyond the machine */
+};
+
+typedef struct Port Port;
+struct Port{
+	uint8_t (*in)(Machine *m, uint8_t port, uint8_t reg);
+	void (*out)(Machine *m, uint8_t port, uint8_t reg, uint8_t val);
+	Device *dev;
+	uint8_t reg;
+	uint8_t idle;
+};
+
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t dump;
+static int engine = ENGINE_CACHE;
+static int hostdir = -1;
+static long baud = 115200;
+static char *uartsock;
+static char *profpath;
+static char *tracepath;
+static char *recpath;
+static char *playpath;
+static long aheadframes;
+static int latency;
+static Port bus[256];
+static Device *devices[8];
+static int ndevices;
+
 static const uint8_t js_guid[] = {
 	0x05, 0x00, 0x00, 0x00, 0x4c, 0x05, 0x00, 0x00,
 	0xc4, 0x05, 0x00, 0x00, 0x00, 0x81, 0x00, 0x00
@@ -121,6 +455,130 @@ fifo_pop(FIFO *f)
 	return f->buf[f->tail++ & ((sizeof(f->buf) >> f->s) - 1)];
 }
 
+static inline uint32_t
+ring_count(Ring *r)
+{
+	return r->head - r->tail;
+}
+
+static inline uint32_t
+ring_space(Ring *r)
+{
+	return UART_RING - ring_count(r);
+}
+
+static inline void
+schedule(Machine *m, int ev, uint64_t when)
+{
+	m->ev[ev] = when;
+	if(when < m->next)
+		m->next = when;
+	if(when < m->stop)
+		m->stop = when;
+}
+
+/* the engine only has a per-sample entry point */
+static void
+psg_render(SNG *sng, int16_t *buf, int n)
+{
+	while(n-- > 0)
+		*buf++ = SNG_calc(sng);
+}
+
+/* render PSG output up to the current cycle into the audio ring */
+static void
+psg_sync(Machine *m)
+{
+	Audio *a;
+	int16_t drop[256];
+	uint64_t now;
+	int head, n, k;
+
+	a = m->audio;
+	now = (uint64_t)m->cpu.cyc << 16;
+	if(now <= a->pos)
+		return;
+	n = (now - a->pos + a->rate - 1) / a->rate;
+	a->pos += n * a->rate;
+
+	head = SDL_AtomicGet(&a->head);
+	k = (SDL_AtomicGet(&a->tail) - head - 1) & (AUDIO_SIZE - 1);
+	if(k > n)
+		k = n;
+	n -= k;
+	while(k > 0){
+		if(k < AUDIO_SIZE - head){
+			psg_render(m->sng, a->buf + head, k);
+			head += k;
+			k = 0;
+		}else{
+			psg_render(m->sng, a->buf + head, AUDIO_SIZE - head);
+			k -= AUDIO_SIZE - head;
+			head = 0;
+		}
+	}
+	SDL_AtomicSet(&a->head, head);
+
+	/* ring full: keep the generator in time, drop the samples */
+	if(n > 0)
+		a->overruns++;
+	for(; n > 0; n -= k){
+		k = n < (int)(sizeof(drop) / sizeof(drop[0])) ? n : (int)(sizeof(drop) / sizeof(drop[0]));
+		psg_render(m->sng, drop, k);
+	}
+}
+
+static inline uint64_t
+uart_rxtime(Machine *m)
+{
+	if(m->uart_rxt + m->uart_cycles > m->cpu.cyc)
+		return m->uart_rxt + m->uart_cycles;
+	return m->cpu.cyc;
+}
+
+static inline int
+samestate(i8080 *a, i8080 *b)
+{
+	return a->pc == b->pc && a->sp == b->sp &&
+		a->a == b->a && a->b == b->b && a->c == b->c && a->d == b->d &&
+		a->e == b->e && a->h == b->h && a->l == b->l &&
+		a->sf == b->sf && a->zf == b->zf && a->hf == b->hf &&
+		a->pf == b->pf && a->cf == b->cf && a->iff == b->iff &&
+		a->interrupt_delay == b->interrupt_delay;
+}
+
+/*
+ * Called on every status port read. When the machine comes back to the
+ * same state at the same read with no memory write or other I/O in
+ * between, it is spinning in a loop that only an event can break, so
+ * skip whole loop iterations up to the next event.
+ */
+static void
+idle(Machine *m)
+{
+	i8080 *cpu;
+	uint64_t period;
+
+	cpu = &m->cpu;
+	if(m->idle_pc == cpu->pc && m->idle_writes == m->writes && m->idle_ppi_c == m->ppi_c && samestate(cpu, &m->idle_cpu)){
+		period = cpu->cyc - m->idle_cyc;
+		if(period > 0 && m->stop > cpu->cyc){
+			period *= (m->stop - cpu->cyc) / period;
+			cpu->cyc += period;
+			m->idle_skip += period;
+		}
+		m->idle_cyc = cpu->cyc;
+		return;
+	}
+	if(m->idle_pc < 0 || m->idle_pc == cpu->pc || cpu->cyc - m->idle_cyc > IDLE_MAX){
+		m->idle_pc = cpu->pc;
+		m->idle_writes = m->writes;
+		m->idle_cyc = cpu->cyc;
+		m->idle_ppi_c = m->ppi_c;
+		m->idle_cpu = *cpu;
+	}
+}
+
 static uint8_t
 read_byte(void *userdata, uint16_t addr)
 {
@@ -130,284 +588,701 @@ read_byte(void *userdata, uint16_t addr)
 	return m->map[addr >> 14][addr & 0x3fff];
 }
 
+/* a write or port access of the instruction just traced */
+static void
+trace_access(Machine *m, uint8_t kind, uint16_t addr, uint8_t val)
+{
+	TraceRec r;
+
+	r.cyc = m->cpu.cyc;
+	r.addr = addr;
+	r.sp = m->cpu.sp;
+	r.banks = m->banks;
+	r.kind = kind;
+	r.val = val;
+	memset(r.r, 0, sizeof(r.r));
+	trace_put(m->trace, &r);
+}
+
 static void
 write_byte(void *userdata, uint16_t addr, uint8_t val)
 {
 	Machine *m;
+	uint32_t a;
 
 	m = userdata;
-	if(m->map[addr >> 14] != m->rom)
-		m->map[addr >> 14][addr & 0x3fff] = val;
+	m->writes++;
+	a = m->wmap[addr >> 14] + (addr & 0x3fff);
+	if(m->jit && a < SINK)
+		jit_write(m->jit, a);
+	m->ram[a] = val;
+	m->dirty[a >> 8] |= 0xff & ~DIRTY_CODE;	/* dc_write() is exact */
+	if(m->dc)
+		dc_write(m->dc, a);
+	if(m->trace)
+		trace_access(m, TR_WRITE, addr, val);
+}
+
+/* map RAM bank page, or the ROM for 0xf, at slot i */
+static void
+setmap(Machine *m, int i, uint8_t page)
+{
+	page &= 0xf;
+	m->banks = (m->banks & ~(0xf << 4 * i)) | page << 4 * i;
+	m->map[i] = page == 0xf ? m->rom : m->ram + ((uint32_t)page << 14);
+	m->wmap[i] = page == 0xf ? SINK : (uint32_t)page << 14;
+}
+
+/* copy guest memory at addr to and from a host buffer, page by page */
+static void
+mem_put(Machine *m, uint16_t addr, uint8_t *src, unsigned n)
+{
+	unsigned k, off;
+	uint8_t *p;
+
+	m->idle_pc = -1;
+	for(k = 0; m->trace && k < n; k++)
+		trace_access(m, TR_WRITE, addr + k, src[k]);
+	while(n > 0){
+		off = addr & 0x3fff;
+		k = 0x4000 - off < n ? 0x4000 - off : n;
+		p = m->map[addr >> 14];
+		if(p != m->rom){
+			memcpy(p + off, src, k);
+			memset(m->dirty + ((p - m->ram + off) >> 8), 0xff, ((p - m->ram + off + k - 1) >> 8) - ((p - m->ram + off) >> 8) + 1);
+		}
+		addr += k;
+		src += k;
+		n -= k;
+	}
+	if(m->jit)
+		jit_flush(m->jit);
+}
+
+static void
+mem_get(Machine *m, uint16_t addr, uint8_t *dst, unsigned n)
+{
+	unsigned k, off;
+
+	while(n > 0){
+		off = addr & 0x3fff;
+		k = 0x4000 - off < n ? 0x4000 - off : n;
+		memcpy(dst, m->map[addr >> 14] + off, k);
+		addr += k;
+		dst += k;
+		n -= k;
+	}
+}
+
+static void
+cf_next(Machine *m)
+{
+	m->cf_bcount = 0;
+	m->cf_scount--;
+	if(m->cf_scount == 0){
+		m->cf_status = 0;
+		m->cf_buf = NULL;
+	}else{
+		m->cf_lba++;
+		m->cf_buf = cf_sector(m->cf, m->cf_lba, m->cf_cmd == 0x30);
+	}
+}
+
+/*
+ * The guest moves sectors with
+ *
+ *	loop:	IN CF		or	loop:	MOV A,M
+ *		MOV M,A				OUT CF
+ *		INX H				INX H
+ *		DCR B (or C)			DCR B (or C)
+ *		JNZ loop			JNZ loop
+ *
+ * 37 cycles a byte. Called from inside the IN or OUT, this returns how
+ * many further iterations can be done in one go without crossing the
+ * sector, the next event or an interrupt the loop would have taken,
+ * and the counter register.
+ */
+#define LOOP_CYCLES 37
+
+static unsigned
+cf_loop(Machine *m, uint8_t port, int out, uint8_t **cnt)
+{
+	static const uint8_t rd[8] = {0xdb, 0, 0x77, 0x23, 0, 0xc2};
+	static const uint8_t wr[8] = {0x7e, 0xd3, 0, 0x23, 0, 0xc2};
+	i8080 *cpu;
+	uint8_t code[8], op;
+	uint16_t top;
+	unsigned n, r;
+
+	cpu = &m->cpu;
+	if(m->trace)
+		return 0;	/* a trace holds every instruction */
+	if(m->cf_buf == NULL || cpu->cyc >= m->stop || (cpu->iff && (m->ppi_c & (KINT | VINT | UINT))))
+		return 0;
+	top = cpu->pc - (out ? 3 : 2);
+	mem_get(m, top, code, 8);
+	op = code[out ? 2 : 1];
+	code[out ? 2 : 1] = 0;
+	if(code[4] == 0x05)
+		*cnt = &cpu->b;
+	else if(code[4] == 0x0d)
+		*cnt = &cpu->c;
+	else
+		return 0;
+	code[4] = 0;
+	if(op != port || memcmp(code, out ? wr : rd, 6) != 0 || (code[6] | code[7] << 8) != top)
+		return 0;
+	r = **cnt ? **cnt : 256;
+	n = (m->stop - cpu->cyc) / LOOP_CYCLES;
+	if(n > r - 1)
+		n = r - 1;
+	if(n > 511U + out - m->cf_bcount)	/* the IN still reads one */
+		n = 511 + out - m->cf_bcount;
+	return n;
 }
 
 static uint8_t
-port_in(void *userdata, uint8_t port)
+bank_in(Machine *m, uint8_t port, uint8_t reg)
+{
+	if(m->map[reg] == m->rom)
+		return 0xff;
+	return ((m->map[reg] - m->ram) >> 14) | 0xf0;
+}
+
+static void
+bank_out(Machine *m, uint8_t port, uint8_t reg, uint8_t val)
+{
+	setmap(m, reg, val);
+}
+
+static void
+bank_reset(Machine *m)
+{
+	setmap(m, 0, 0xf);
+	setmap(m, 1, 0xf);
+	setmap(m, 2, 0xf);
+	setmap(m, 3, 0xf);
+}
+
+/* port C UINT: the UART when enabled, or any EXT device */
+static void
+uint_line(Machine *m)
+{
+	m->ppi_c &= ~UINT;
+	if(((m->uart_status & RXRDY) && (m->ppi_c & UINTE)) || m->ext_irq)
+		m->ppi_c |= UINT;
+}
+
+static uint8_t
+uart_in(Machine *m, uint8_t port, uint8_t reg)
 {
-	Machine *m;
 	uint8_t d;
 
-	m = userdata;
-//	printf("read port %02x\n", port);
-	switch(port & 0x38){
-	case 0x08:	/* BANK */
-		if(m->map[port >> 6] == m->rom)
-			return 0xff;
-		else
-			return ((m->map[port >> 6] - m->ram) >> 14) | 0xf0;
-	case 0x28:	/* UART */
-		switch(port & 1){
-		case 0:	/* data */
-			d = m->uart_rx;
-			m->uart_status &= ~RXRDY;
-			m->ppi_c &= ~UINT;
-			if(fifo_count(&m->uart_fifo)){
-				m->uart_rx = fifo_pop(&m->uart_fifo);
-				m->uart_status |= RXRDY;
-				if(m->ppi_c & UINTE)
-					m->ppi_c |= UINT;
-			}
-			return d;
-		case 1: /* status */
-			return m->uart_status;
-		}
-	case 0x30:	/* CF */
-		switch(port & 7){
-		case 0:	/* data */
-			d = *(m->cf_data + m->cf_lba * 512 + m->cf_bcount);
-			m->cf_bcount++;
-			if(m->cf_bcount == 512){
-				m->cf_bcount = 0;
-				m->cf_scount--;
-				if(m->cf_scount == 0)
-					m->cf_status = 0;
-				else
-					m->cf_lba++;
-			}
-			return d;
-		case 1: /* error */
-			return 0;
-		case 2:	/* sector count */
-			return m->cf_scount & 0xff;
-		case 3: /* lba0 */
-			return m->cf_lba & 0xff;
-		case 4:	/* lba1 */
-			return (m->cf_lba >> 8) & 0xff;
-		case 5: /* lba2 */
-			return (m->cf_lba >> 16) & 0xff;
-		case 6:	/* lba3 */
-			return ((m->cf_lba >> 24) & 0x0f) | 0xe0;
-		case 7: /* status */
-			if((m->cf_status & 0x08) && (m->cf_lba * 512 + m->cf_bcount >= m->cf_size))
-				m->cf_status = 0x01;
-			return m->cf_status;
-		}
-	case 0x18:	/* PPI */
-		switch(port & 5){
-		case 0: /* port a */
-			m->ppi_c &= ~(KIBF | KINT);
-			return m->ppi_a;
-		case 1: /* port b */
-			d = m->ppi_b;
-			if((port & 2) && !(m->ppi_b & SEL)){
-				m->js_state = (m->js_state + 1) & 3;
-				m->js_timer = 0;
-				m->ppi_b |= UP | DOWN | LEFT | RIGHT | AB | STRTC;
-				if(m->js_state == 3){
-					if(m->js_buttons & BUTTON_Z)
-						m->ppi_b &= ~UP;
-					if(m->js_buttons & BUTTON_Y)
-						m->ppi_b &= ~DOWN;
-					if(m->js_buttons & BUTTON_X)
-						m->ppi_b &= ~LEFT;
-					if(m->js_buttons & BUTTON_M)
-						m->ppi_b &= ~RIGHT;
-					if(m->js_buttons & BUTTON_B)
-						m->ppi_b &= ~AB;
-					if(m->js_buttons & BUTTON_C)
-						m->ppi_b &= ~STRTC;
-				}else{
-					if(m->js_buttons & BUTTON_U)
-						m->ppi_b &= ~UP;
-					if(m->js_buttons & BUTTON_D)
-						m->ppi_b &= ~DOWN;
-					if(m->js_buttons & BUTTON_L)
-						m->ppi_b &= ~LEFT;
-					if(m->js_buttons & BUTTON_R)
-						m->ppi_b &= ~RIGHT;
-					if(m->js_buttons & BUTTON_B)
-						m->ppi_b &= ~AB;
-					if(m->js_buttons & BUTTON_C)
-						m->ppi_b &= ~STRTC;
-				}
-				m->ppi_b |= SEL;
-			}else if(!(port & 2) && (m->ppi_b & SEL)){
-				m->ppi_b |= UP | DOWN | LEFT | RIGHT | AB | STRTC;
-				if(m->js_state == 2){
-					m->ppi_b &= ~(UP | DOWN | LEFT | RIGHT);
-					if(m->js_buttons & BUTTON_A)
-						m->ppi_b &= ~AB;
-					if(m->js_buttons & BUTTON_S)
-						m->ppi_b &= ~STRTC;
-				}else if(m->js_state == 3){
-					if(m->js_buttons & BUTTON_A)
-						m->ppi_b &= ~AB;
-					if(m->js_buttons & BUTTON_S)
-						m->ppi_b &= ~STRTC;
-				}else{
-					m->ppi_b &= ~(LEFT | RIGHT);
-					if(m->js_buttons & BUTTON_U)
-						m->ppi_b &= ~UP;
-					if(m->js_buttons & BUTTON_D)
-						m->ppi_b &= ~DOWN;
-					if(m->js_buttons & BUTTON_A)
-						m->ppi_b &= ~AB;
-					if(m->js_buttons & BUTTON_S)
-						m->ppi_b &= ~STRTC;
-				}
-				m->ppi_b &= ~SEL;
-			}
-			return d;
-		case 4: /* port c */
-			d = m->ppi_c;
-			m->ppi_c &= ~VINT;
-			return d;
-		case 5: /* illegal */
-			break;
-		}
+	switch(reg){
+	case 0:	/* data */
+		d = m->uart_rx;
+		m->uart_status &= ~RXRDY;
+		uint_line(m);
+		if(fifo_count(&m->uart_fifo) && m->ev[EV_UART_RX] == NEVER)
+			schedule(m, EV_UART_RX, uart_rxtime(m));
+		return d;
+	case 1: /* status */
+		return m->uart_status;
+	}
+	return 0xff;
+}
+
+static void
+uart_out(Machine *m, uint8_t port, uint8_t reg, uint8_t val)
+{
+	switch(reg){
+	case 0:	/* data */
+		m->uart_status &= ~TXRDY;
+		m->uart_tx = val;
+		schedule(m, EV_UART_TX, m->cpu.cyc + m->uart_cycles);
 		break;
-	case 0x38:	/* PSG */
-	case 0x00:	/* EXT0 */
-	case 0x10:	/* EXT1 */
-	case 0x20:	/* EXT2 */
+	case 1: /* control */
 		break;
 	}
+}
+
+static void
+uart_reset(Machine *m)
+{
+	m->uart_status = TXRDY;
+	m->uart_fifo.head = 0;
+	m->uart_fifo.tail = sizeof(m->uart_fifo.buf) >> m->uart_fifo.s;
+	m->ev[EV_UART_TX] = NEVER;
+	m->ev[EV_UART_RX] = NEVER;
+}
+
+static uint8_t
+cf_in(Machine *m, uint8_t port, uint8_t reg)
+{
+	uint8_t *cnt, d;
+	uint16_t hl;
+	unsigned n;
+
+	switch(reg){
+	case 0:	/* data */
+		if((n = cf_loop(m, port, 0, &cnt)) > 0){
+			hl = m->cpu.h << 8 | m->cpu.l;
+			mem_put(m, hl, m->cf_buf + m->cf_bcount, n);
+			hl += n;
+			m->cpu.h = hl >> 8;
+			m->cpu.l = hl;
+			*cnt -= n;
+			m->cpu.cyc += n * LOOP_CYCLES;
+			m->cf_insns += n * 5;
+			m->cf_bcount += n;
+		}
+		d = m->cf_buf ? m->cf_buf[m->cf_bcount] : 0xff;
+		if(++m->cf_bcount == 512)
+			cf_next(m);
+		return d;
+	case 1: /* error */
+		return 0;
+	case 2:	/* sector count */
+		return m->cf_scount & 0xff;
+	case 3: /* lba0 */
+		return m->cf_lba & 0xff;
+	case 4:	/* lba1 */
+		return (m->cf_lba >> 8) & 0xff;
+	case 5: /* lba2 */
+		return (m->cf_lba >> 16) & 0xff;
+	case 6:	/* lba3 */
+		return ((m->cf_lba >> 24) & 0x0f) | 0xe0;
+	case 7: /* status */
+		if((m->cf_status & 0x08) && (m->cf_lba * 512 + m->cf_bcount >= m->cf_size))
+			m->cf_status = 0x01;
+		return m->cf_status;
+	}
 	return 0xff;
 }
 
 static void
-port_out(void *userdata, uint8_t port, uint8_t val)
+cf_out(Machine *m, uint8_t port, uint8_t reg, uint8_t val)
 {
-	Machine *m;
-	uint8_t bit;
+	uint8_t *cnt;
+	uint16_t hl;
+	unsigned n;
 
-	m = userdata;
-//	printf("write port %02x val %02x\n", port, val);
-	switch(port & 0x38){
-	case 0x08:	/* BANK */
-		if((val & 0xf) == 0xf)
-			m->map[port >> 6] = m->rom;
-		else
-			m->map[port >> 6] = m->ram + (((uint32_t)val & 0xf) << 14);
+	switch(reg){
+	case 0: /* data */
+		if(m->cf_cmd != 0x30 || m->cf_buf == NULL)
+			break;	/* a read's sector may be the read-only image */
+		m->cf_buf[m->cf_bcount] = val;
+		if(++m->cf_bcount == 512)
+			cf_next(m);
+		if((n = cf_loop(m, port, 1, &cnt)) > 0){
+			hl = m->cpu.h << 8 | m->cpu.l;
+			mem_get(m, hl + 1, m->cf_buf + m->cf_bcount, n);
+			hl += n;
+			m->cpu.h = hl >> 8;
+			m->cpu.l = hl;
+			m->cpu.a = read_byte(m, hl);
+			*cnt -= n;
+			m->cpu.cyc += n * LOOP_CYCLES;
+			m->cf_insns += n * 5;
+			m->cf_bcount += n;
+			if(m->cf_bcount == 512)
+				cf_next(m);
+		}
+		break;
+	case 1: /* feature */
+		break;
+	case 2:	/* sector count */
+		m->cf_scount = val;
+		break;
+	case 3: /* lba0 */
+		m->cf_lba = (m->cf_lba & 0xffffff00) | ((uint32_t)val << 0);
+		break;
+	case 4:	/* lba1 */
+		m->cf_lba = (m->cf_lba & 0xffff00ff) | ((uint32_t)val << 8);
+		break;
+	case 5: /* lba2 */
+		m->cf_lba = (m->cf_lba & 0xff00ffff) | ((uint32_t)val << 16);
+		break;
+	case 6:	/* lba3 */
+		m->cf_lba = (m->cf_lba & 0x00ffffff) | ((uint32_t)(val & 0x0f) << 24);
 		break;
-	case 0x28:	/* UART */
-		switch(port & 1){
-		case 0:	/* data */
-			m->uart_status &= ~TXRDY;
-			m->uart_tx = val;
+	case 7: /* command */
+		switch(val){
+		case 0x20: /* read sectors */
+		case 0x30: /* write sectors */
+			if(m->cf_scount == 0)
+				m->cf_scount = 256;
+			m->cf_bcount = 0;
+			m->cf_status = 0x08;
+			m->cf_cmd = val;
+			m->cf_buf = cf_sector(m->cf, m->cf_lba, val == 0x30);
 			break;
-		case 1: /* control */
+		case 0xef: /* set features */
 			break;
 		}
 		break;
-	case 0x30:	/* CF */
-		switch(port & 7){
-		case 0: /* data */
-			*(m->cf_data + m->cf_lba * 512 + m->cf_bcount) = val;
-			m->cf_bcount++;
-			if(m->cf_bcount == 512){
-				m->cf_bcount = 0;
-				m->cf_scount--;
-				if(m->cf_scount == 0)
-					m->cf_status = 0;
-				else
-					m->cf_lba++;
+	}
+}
+
+static void
+cf_reset(Machine *m)
+{
+	m->cf_status = 0;
+	m->cf_buf = NULL;
+}
+
+static uint8_t
+ppi_in(Machine *m, uint8_t port, uint8_t reg)
+{
+	uint8_t d;
+
+	switch(reg & 5){
+	case 0: /* port a */
+		if(m->lat && m->lat->state == 2){
+			m->lat->t1 = pool_now();
+			m->lat->cycles += m->cpu.cyc - m->lat->cyc;
+			m->lat->state = 3;
+		}
+		m->ppi_c &= ~(KIBF | KINT);
+		if(fifo_count(&m->kb_fifo) && m->ev[EV_KBD] == NEVER)
+			schedule(m, EV_KBD, m->cpu.cyc + KBD_CYCLES);
+		return m->ppi_a;
+	case 1: /* port b */
+		d = m->ppi_b;
+		if((reg & 2) && !(m->ppi_b & SEL)){
+			m->js_state = (m->js_state + 1) & 3;
+			schedule(m, EV_JS, m->cpu.cyc + JS_TIMEOUT);
+			m->ppi_b |= UP | DOWN | LEFT | RIGHT | AB | STRTC;
+			if(m->js_state == 3){
+				if(m->js_buttons & BUTTON_Z)
+					m->ppi_b &= ~UP;
+				if(m->js_buttons & BUTTON_Y)
+					m->ppi_b &= ~DOWN;
+				if(m->js_buttons & BUTTON_X)
+					m->ppi_b &= ~LEFT;
+				if(m->js_buttons & BUTTON_M)
+					m->ppi_b &= ~RIGHT;
+				if(m->js_buttons & BUTTON_B)
+					m->ppi_b &= ~AB;
+				if(m->js_buttons & BUTTON_C)
+					m->ppi_b &= ~STRTC;
+			}else{
+				if(m->js_buttons & BUTTON_U)
+					m->ppi_b &= ~UP;
+				if(m->js_buttons & BUTTON_D)
+					m->ppi_b &= ~DOWN;
+				if(m->js_buttons & BUTTON_L)
+					m->ppi_b &= ~LEFT;
+				if(m->js_buttons & BUTTON_R)
+					m->ppi_b &= ~RIGHT;
+				if(m->js_buttons & BUTTON_B)
+					m->ppi_b &= ~AB;
+				if(m->js_buttons & BUTTON_C)
+					m->ppi_b &= ~STRTC;
 			}
-			break;
-		case 1: /* feature */
-			break;
-		case 2:	/* sector count */
-			m->cf_scount = val;
-			break;
-		case 3: /* lba0 */
-			m->cf_lba = (m->cf_lba & 0xffffff00) | ((uint32_t)val << 0);
-			break;
-		case 4:	/* lba1 */
-			m->cf_lba = (m->cf_lba & 0xffff00ff) | ((uint32_t)val << 8);
-			break;
-		case 5: /* lba2 */
-			m->cf_lba = (m->cf_lba & 0xff00ffff) | ((uint32_t)val << 16);
-			break;
-		case 6:	/* lba3 */
-			m->cf_lba = (m->cf_lba & 0x00ffffff) | ((uint32_t)(val & 0x0f) << 24);
-			break;
-		case 7: /* command */
-			switch(val){
-			case 0x20: /* read sectors */
-			case 0x30: /* write sectors */
-				if(m->cf_scount == 0)
-					m->cf_scount = 256;
-				m->cf_bcount = 0;
-				m->cf_status = 0x08;
-				break;
-			case 0xef: /* set features */
-				break;
+			m->ppi_b |= SEL;
+		}else if(!(reg & 2) && (m->ppi_b & SEL)){
+			m->ppi_b |= UP | DOWN | LEFT | RIGHT | AB | STRTC;
+			if(m->js_state == 2){
+				m->ppi_b &= ~(UP | DOWN | LEFT | RIGHT);
+				if(m->js_buttons & BUTTON_A)
+					m->ppi_b &= ~AB;
+				if(m->js_buttons & BUTTON_S)
+					m->ppi_b &= ~STRTC;
+			}else if(m->js_state == 3){
+				if(m->js_buttons & BUTTON_A)
+					m->ppi_b &= ~AB;
+				if(m->js_buttons & BUTTON_S)
+					m->ppi_b &= ~STRTC;
+			}else{
+				m->ppi_b &= ~(LEFT | RIGHT);
+				if(m->js_buttons & BUTTON_U)
+					m->ppi_b &= ~UP;
+				if(m->js_buttons & BUTTON_D)
+					m->ppi_b &= ~DOWN;
+				if(m->js_buttons & BUTTON_A)
+					m->ppi_b &= ~AB;
+				if(m->js_buttons & BUTTON_S)
+					m->ppi_b &= ~STRTC;
 			}
-			break;
+			m->ppi_b &= ~SEL;
 		}
+		return d;
+	case 4: /* port c */
+		d = m->ppi_c;
+		m->ppi_c &= ~VINT;
+		return d;
+	case 5: /* illegal */
 		break;
-	case 0x18:	/* PPI */
-		switch(port & 5){
-		case 0: /* port a */
-		case 1: /* port b */
-			break;
-		case 4: /* port c */
+	}
+	return 0xff;
+}
+
+static void
+ppi_out(Machine *m, uint8_t port, uint8_t reg, uint8_t val)
+{
+	uint8_t bit;
+
+	switch(reg & 5){
+	case 0: /* port a */
+	case 1: /* port b */
+		break;
+	case 4: /* port c */
+		m->ppi_c = (m->ppi_c & 0xe8) | (val & 0x17);
+		uint_line(m);
+		break;
+	case 5: /* control */
+		if((val & 0x80) == 0){
+			bit = 1 << ((val >> 1) & 7);
+			if(val & 1)
+				val = m->ppi_c | bit;
+			else
+				val = m->ppi_c & ~bit;
 			m->ppi_c = (m->ppi_c & 0xe8) | (val & 0x17);
-			m->ppi_c &= ~UINT;
-			m->ppi_c |= ((m->uart_status & RXRDY) << 6) & ((m->ppi_c & UINTE) << 5);
-			break;
-		case 5: /* control */
-			if((val & 0x80) == 0){
-				bit = 1 << ((val >> 1) & 7);
-				if(val & 1)
-					val = m->ppi_c | bit;
-				else
-					val = m->ppi_c & ~bit;
-				m->ppi_c = (m->ppi_c & 0xe8) | (val & 0x17);
-				m->ppi_c &= ~UINT;
-				m->ppi_c |= ((m->uart_status & RXRDY) << 6) & ((m->ppi_c & UINTE) << 5);
-			}
+			uint_line(m);
+		}
+		break;
+	}
+}
+
+static void
+ppi_reset(Machine *m)
+{
+	m->ppi_c = 0x01;
+	m->kb_fifo.head = 0;
+	m->kb_fifo.tail = sizeof(m->kb_fifo.buf) >> m->kb_fifo.s;
+	m->ev[EV_KBD] = NEVER;
+}
+
+static void
+psg_out(Machine *m, uint8_t port, uint8_t reg, uint8_t val)
+{
+	if(m->audio)
+		psg_sync(m);
+	SNG_writeIO(m->sng, val);
+}
+
+/*
+ * HOST, a paravirtual device on EXT0 moving whole blocks between guest
+ * memory and files in the host directory given with -H:
+ *
+ *	0	command (W) or status (R): HBUSY HDONE HEOF HERR
+ *	1	file name, a byte per write, taken by the next command
+ *	2, 3	memory address, low and high
+ *	4, 5	byte count, low and high; bytes moved after READ
+ *	6	control: HIE interrupts on completion
+ *
+ * Commands: 1 open for reading, 2 create for writing, 3 read count bytes
+ * to memory, 4 write count bytes from memory, 5 close. A command
+ * completes within the OUT; with HIE it requests an interrupt on the
+ * UART line of port C until the status is read. Names are plain file
+ * names, without a slash or a leading dot.
+ */
+static void
+host_cmd(Machine *m, uint8_t cmd)
+{
+	uint8_t *buf;
+	unsigned n;
+	ssize_t k;
+	char *name;
+
+	name = m->host_name;
+	name[m->host_len] = '\0';
+	m->host_len = 0;
+	m->host_status = 0;
+	switch(cmd){
+	case 1:	/* open */
+	case 2:	/* create */
+		if(m->host_fd >= 0)
+			close(m->host_fd);
+		m->host_fd = -1;
+		if(name[0] == '\0' || name[0] == '.' || strchr(name, '/'))
+			break;
+		if(cmd == 1)
+			m->host_fd = openat(hostdir, name, O_RDONLY | O_NOFOLLOW);
+		else
+			m->host_fd = openat(hostdir, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0666);
+		if(m->host_fd >= 0)
+			m->host_status = HDONE;
+		break;
+	case 3:	/* read */
+		if(m->host_fd < 0 || (buf = malloc(m->host_count + 1)) == NULL)
 			break;
+		k = 0;
+		for(n = 0; n < m->host_count; n += k)
+			if((k = read(m->host_fd, buf + n, m->host_count - n)) <= 0)
+				break;
+		if(k >= 0){
+			mem_put(m, m->host_addr, buf, n);
+			m->host_status = n == 0 && m->host_count > 0 ? HDONE | HEOF : HDONE;
+			m->host_count = n;
 		}
+		free(buf);
 		break;
-	case 0x38:	/* PSG */
-		SNG_writeIO(m->sng, val);
+	case 4:	/* write */
+		if(m->host_fd < 0 || (buf = malloc(m->host_count + 1)) == NULL)
+			break;
+		mem_get(m, m->host_addr, buf, m->host_count);
+		for(n = 0; n < m->host_count; n += k)
+			if((k = write(m->host_fd, buf + n, m->host_count - n)) <= 0)
+				break;
+		if(n == m->host_count)
+			m->host_status = HDONE;
+		free(buf);
 		break;
-	case 0x00:	/* EXT0 */
-	case 0x10:	/* EXT1 */
-	case 0x20:	/* EXT2 */
+	case 5:	/* close */
+		if(m->host_fd >= 0 && close(m->host_fd) == 0)
+			m->host_status = HDONE;
+		m->host_fd = -1;
 		break;
 	}
+	if(m->host_status == 0)
+		m->host_status = HDONE | HERR;
+	if(m->host_ctrl & HIE){
+		m->ext_irq |= HINT;
+		uint_line(m);
+	}
 }
 
-static const uint8_t xlat[SDL_NUM_SCANCODES] = {
-	[SDL_SCANCODE_A]            = 0x1e,
-	[SDL_SCANCODE_B]            = 0x30,
-	[SDL_SCANCODE_C]            = 0x2e,
-	[SDL_SCANCODE_D]            = 0x20,
-	[SDL_SCANCODE_E]            = 0x12,
-	[SDL_SCANCODE_F]            = 0x21,
-	[SDL_SCANCODE_G]            = 0x22,
-	[SDL_SCANCODE_H]            = 0x23,
-	[SDL_SCANCODE_I]            = 0x17,
-	[SDL_SCANCODE_J]            = 0x24,
-	[SDL_SCANCODE_K]            = 0x25,
-	[SDL_SCANCODE_L]            = 0x26,
-	[SDL_SCANCODE_M]            = 0x32,
-	[SDL_SCANCODE_N]            = 0x31,
-	[SDL_SCANCODE_O]            = 0x18,
-	[SDL_SCANCODE_P]            = 0x19,
-	[SDL_SCANCODE_Q]            = 0x10,
-	[SDL_SCANCODE_R]            = 0x13,
+static uint8_t
+host_in(Machine *m, uint8_t port, uint8_t reg)
+{
+	uint8_t d;
+
+	switch(reg){
+	case 0:	/* status */
+		d = m->host_status;
+		m->host_status &= ~HDONE;
+		m->ext_irq &= ~HINT;
+		uint_line(m);
+		return d;
+	case 2:
+		return m->host_addr & 0xff;
+	case 3:
+		return m->host_addr >> 8;
+	case 4:
+		return m->host_count & 0xff;
+	case 5:
+		return m->host_count >> 8;
+	case 6:
+		return m->host_ctrl;
+	}
+	return 0xff;
+}
+
+static void
+host_out(Machine *m, uint8_t port, uint8_t reg, uint8_t val)
+{
+	switch(reg){
+	case 0:
+		host_cmd(m, val);
+		break;
+	case 1:
+		if(m->host_len < sizeof(m->host_name) - 1)
+			m->host_name[m->host_len++] = val;
+		break;
+	case 2:
+		m->host_addr = (m->host_addr & 0xff00) | val;
+		break;
+	case 3:
+		m->host_addr = (m->host_addr & 0x00ff) | val << 8;
+		break;
+	case 4:
+		m->host_count = (m->host_count & 0xff00) | val;
+		break;
+	case 5:
+		m->host_count = (m->host_count & 0x00ff) | val << 8;
+		break;
+	case 6:
+		m->host_ctrl = val;
+		break;
+	}
+}
+
+static void
+host_reset(Machine *m)
+{
+	if(m->host_fd >= 0)
+		close(m->host_fd);
+	m->host_fd = -1;
+	m->host_len = 0;
+	m->host_status = 0;
+	m->host_ctrl = 0;
+	m->ext_irq &= ~HINT;
+}
+
+/* an empty select */
+static uint8_t
+none_in(Machine *m, uint8_t port, uint8_t reg)
+{
+	return 0xff;
+}
+
+static void
+none_out(Machine *m, uint8_t port, uint8_t reg, uint8_t val)
+{
+}
+
+static uint8_t
+port_in(void *userdata, uint8_t port)
+{
+	Machine *m;
+	Port *p;
+	uint8_t d;
+
+	m = userdata;
+	p = &bus[port];
+	if(m->prof)
+		prof_port(m->prof, port, 0);
+	if(p->idle)
+		idle(m);
+	else
+		m->idle_pc = -1;
+	d = p->in(m, port, p->reg);
+	if(m->trace)
+		trace_access(m, TR_IN, port, d);
+	return d;
+}
+
+static void
+port_out(void *userdata, uint8_t port, uint8_t val)
+{
+	Machine *m;
+	Port *p;
+
+	m = userdata;
+	m->idle_pc = -1;
+	p = &bus[port];
+	if(m->prof)
+		prof_port(m->prof, port, 1);
+	if(m->trace)
+		trace_access(m, TR_OUT, port, val);
+	if(m->speculative && p->dev && p->dev->outside){
+		m->ahead->held++;
+		return;
+	}
+	p->out(m, port, p->reg, val);
+}
+
+static const uint8_t xlat[SDL_NUM_SCANCODES] = {
+	[SDL_SCANCODE_A]            = 0x1e,
+	[SDL_SCANCODE_B]            = 0x30,
+	[SDL_SCANCODE_C]            = 0x2e,
+	[SDL_SCANCODE_D]            = 0x20,
+	[SDL_SCANCODE_E]            = 0x12,
+	[SDL_SCANCODE_F]            = 0x21,
+	[SDL_SCANCODE_G]            = 0x22,
+	[SDL_SCANCODE_H]            = 0x23,
+	[SDL_SCANCODE_I]            = 0x17,
+	[SDL_SCANCODE_J]            = 0x24,
+	[SDL_SCANCODE_K]            = 0x25,
+	[SDL_SCANCODE_L]            = 0x26,
+	[SDL_SCANCODE_M]            = 0x32,
+	[SDL_SCANCODE_N]            = 0x31,
+	[SDL_SCANCODE_O]            = 0x18,
+	[SDL_SCANCODE_P]            = 0x19,
+	[SDL_SCANCODE_Q]            = 0x10,
+	[SDL_SCANCODE_R]            = 0x13,
 	[SDL_SCANCODE_S]            = 0x1f,
 	[SDL_SCANCODE_T]            = 0x14,
 	[SDL_SCANCODE_U]            = 0x16,
@@ -498,352 +1373,2726 @@ static const uint8_t xlat[SDL_NUM_SCANCODES] = {
 	[SDL_SCANCODE_RGUI]         = 0x5c,
 };
 
+static void rewind_capture(Machine *m);
+static void rec_put(Machine *m, uint8_t kind, uint32_t val);
+
 static void
 reset(Machine *m)
 {
-	m->map[0] = m->rom;
-	m->map[1] = m->rom;
-	m->map[2] = m->rom;
-	m->map[3] = m->rom;
-
-	m->uart_status = TXRDY;
-	m->uart_fifo.head = 0;
-	m->uart_fifo.tail = sizeof(m->uart_fifo.buf) >> m->uart_fifo.s;
+	int i;
 
-	m->ppi_c = 0x01;
+	for(i = 0; i < ndevices; i++)
+		if(devices[i]->reset)
+			devices[i]->reset(m);
 
-	m->kb_fifo.head = 0;
-	m->kb_fifo.tail = sizeof(m->kb_fifo.buf) >> m->kb_fifo.s;
+	m->cpu.pc = 0;
+	m->cpu.iff = 0;
+	m->cpu.halted = 0;
+	m->cpu.interrupt_pending = 0;
+}
 
-	m->cf_status = 0;
+static void
+ev_vint(Machine *m, uint64_t t)
+{
+	if(m->ppi_c & VINTE)
+		m->ppi_c |= VINT;
+	m->frame++;
+	schedule(m, EV_VINT, (m->frame + 1) * CPU_HZ / 60);
+	if(m->rewind && !m->speculative)
+		rewind_capture(m);
 }
 
-void
-audio_cb(void *userdata, uint8_t *stream, int len)
+static void
+ev_kbd(Machine *m, uint64_t t)
 {
-	Machine *m = userdata;
+	if(m->ppi_c & KIBF)
+		return;
+	m->ppi_a = fifo_pop(&m->kb_fifo);
+	if(m->lat && m->lat->state == 1 && m->ppi_a == m->lat->code)
+		m->lat->state = 2;
+	m->ppi_c |= KIBF;
+	if(m->ppi_c & KINTE)
+		m->ppi_c |= KINT;
+}
 
-	for(; len > 0; len -= 2, stream += 2)
-		*(int16_t *)stream = SNG_calc(m->sng);
+static void
+ev_js(Machine *m, uint64_t t)
+{
+	m->js_state = 0;
 }
 
-enum{
-	FDS_CPU,
-	FDS_PTY,
-	FDS_SDL,
-	NFDS
-};
+/* the peer went away: its pending output goes with it */
+static void
+uart_hangup(Machine *m)
+{
+	close(m->uart_fd);
+	m->uart_fd = -1;
+	m->uart_out.tail = m->uart_out.head;
+}
 
-int
-main(int argc, char *argv[])
+/*
+ * Write out as much of the transmit ring as the host takes without
+ * blocking. With nobody on the line, output is dropped as a real
+ * unconnected port would; a slow reader holds the transmitter busy.
+ */
+static void
+uart_send(Machine *m)
 {
-	i8080 cpu;
-	Machine	machine;
-	Machine *m;
-	int romfd, cffd, ret, pitch, x, y, buttonid;
-	struct pollfd fds[NFDS];
-	uint64_t val;
-	struct itimerspec it, stop = {0};
-	SDL_Window *window;
-	SDL_Renderer *renderer;
-	SDL_RendererInfo info;
-	Uint32 format, p0, p1, p2;
-	SDL_PixelFormat *pixelformat;
-	SDL_Texture *texture;
-	SDL_Event event;
-	Uint32 *pixels;
-	uint8_t *plane, *src;
-	uint8_t b;
-	SDL_MessageBoxData messageboxdata;
-	SDL_MessageBoxButtonData buttons[3];
-	SDL_AudioSpec want = {0}, have;
-	SDL_AudioDeviceID audiodev;
-	SDL_Joystick *js;
-	SDL_JoystickGUID guid;
+	Ring *r;
+	uint32_t n;
+	ssize_t ret;
 
-	if(argc < 3){
-		fprintf(stderr, "usage: %s romfile cffile\n", argv[0]);
-		exit(EXIT_FAILURE);
+	r = &m->uart_out;
+	while(ring_count(r)){
+		if(m->uart_fd < 0){
+			r->tail = r->head;
+			break;
+		}
+		n = UART_RING - (r->tail & (UART_RING - 1));
+		if(n > ring_count(r))
+			n = ring_count(r);
+		ret = write(m->uart_fd, r->buf + (r->tail & (UART_RING - 1)), n);
+		if(ret > 0){
+			r->tail += ret;
+			continue;
+		}
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			break;
+		if(m->uart_lfd >= 0)
+			uart_hangup(m);
+		else
+			r->tail = r->head;
 	}
+}
 
-	m = &machine;
+/* received bytes move into the FIFO as it makes room */
+static void
+uart_fill(Machine *m)
+{
+	Ring *r;
 
-	i8080_init(&cpu);
-	cpu.read_byte = read_byte;
-	cpu.write_byte = write_byte;
-	cpu.port_in = port_in;
-	cpu.port_out = port_out;
-	cpu.userdata = m;
+	r = &m->uart_in;
+	while(ring_count(r) && fifo_space(&m->uart_fifo))
+		fifo_push(&m->uart_fifo, r->buf[r->tail++ & (UART_RING - 1)]);
+	if(fifo_count(&m->uart_fifo) && !(m->uart_status & RXRDY) && m->ev[EV_UART_RX] == NEVER)
+		schedule(m, EV_UART_RX, uart_rxtime(m));
+}
 
-	m->ram = malloc(256 * 1024);
-	if(m->ram == NULL){
-		perror("malloc()");
-		exit(EXIT_FAILURE);
-	}
+/*
+ * How much of the prompt the output ends with once c follows the at
+ * bytes matched: on a mismatch, the longest prefix that is a suffix.
+ */
+static size_t
+prompt_next(char *prompt, size_t at, uint8_t c)
+{
+	size_t k;
 
-	romfd = open(argv[1], O_RDONLY);
-	if(romfd < 0){
-		perror(argv[1]);
-		exit(EXIT_FAILURE);
-	}
-	m->rom = mmap(NULL, 16 * 1024, PROT_READ, MAP_PRIVATE, romfd, 0);
-	if(m->rom == MAP_FAILED){
-		perror("mmap()");
-		exit(EXIT_FAILURE);
-	}
+	if((uint8_t)prompt[at] == c)
+		return at + 1;
+	for(k = at; k > 0; k--)
+		if((uint8_t)prompt[k - 1] == c && memcmp(prompt, prompt + at - k + 1, k - 1) == 0)
+			return k;
+	return 0;
+}
 
-	m->ppi_a = 0xff;
-	m->ppi_b = 0xff;
+/*
+ * The character has been on the line for its time. If the host has
+ * not taken the earlier ones, TXRDY stays low for another character.
+ */
+static void
+ev_uart_tx(Machine *m, uint64_t t)
+{
+	Ring *r;
 
-	m->kb_fifo.s = 2;
-	m->uart_fifo.s = 0;
+	r = &m->uart_out;
+	if(ring_space(r) == 0 && !m->speculative)
+		uart_send(m);
+	if(ring_space(r) == 0 && (m->play || m->rec))
+		r->tail++;	/* the host's pace is not in the log: drop the oldest */
+	if(ring_space(r) == 0){
+		schedule(m, EV_UART_TX, m->cpu.cyc + m->uart_cycles);
+		return;
+	}
+	r->buf[r->head++ & (UART_RING - 1)] = m->uart_tx;
+	m->uart_status |= TXRDY;
+	if(m->prompt && m->prompt[m->prompt_at] != '\0')
+		m->prompt_at = prompt_next(m->prompt, m->prompt_at, m->uart_tx);
+}
 
-	m->js_buttons = 0;
-	m->js_state = 0;
-	m->js_timer = 0;
+static void
+ev_uart_rx(Machine *m, uint64_t t)
+{
+	if(m->uart_status & RXRDY)
+		return;
+	m->uart_rx = fifo_pop(&m->uart_fifo);
+	m->uart_rxt = t;
+	m->uart_status |= RXRDY;
+	uart_fill(m);
+	uint_line(m);
+}
 
-	reset(m);
+static void (*const evfn[NEV])(Machine *, uint64_t) = {
+	[EV_VINT]    = ev_vint,
+	[EV_KBD]     = ev_kbd,
+	[EV_JS]      = ev_js,
+	[EV_UART_TX] = ev_uart_tx,
+	[EV_UART_RX] = ev_uart_rx,
+};
 
-	cffd = open(argv[2], O_RDWR);
-	if(cffd < 0){
-		perror(argv[2]);
-		exit(EXIT_FAILURE);
-	}
-	m->cf_size = lseek(cffd, 0, SEEK_END);
-	lseek(cffd, 0, SEEK_SET);
-	m->cf_data = mmap(NULL, m->cf_size, PROT_READ | PROT_WRITE, MAP_SHARED, cffd, 0);
-	if(m->cf_data == MAP_FAILED){
-		perror("mmap()");
-		exit(EXIT_FAILURE);
+static void
+dispatch(Machine *m)
+{
+	uint64_t t;
+	int i;
+
+	for(i = 0; i < NEV; i++){
+		t = m->ev[i];
+		if(t <= m->cpu.cyc){
+			m->ev[i] = NEVER;
+			evfn[i](m, t);
+		}
 	}
+	m->next = NEVER;
+	for(i = 0; i < NEV; i++)
+		if(m->ev[i] < m->next)
+			m->next = m->ev[i];
+}
 
-	fds[FDS_CPU].fd = timerfd_create(CLOCK_MONOTONIC, 0);
-	fds[FDS_CPU].events = POLLIN;
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_nsec = 320000;
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_nsec = 320000;
-	timerfd_settime(fds[FDS_CPU].fd, 0, &it, NULL);
+static inline uint32_t
+bankpc(Machine *m, uint16_t pc)
+{
+	return PROF_AT(m->banks >> (pc >> 14) * 4 & 0xf, pc);
+}
 
-	fds[FDS_PTY].fd = posix_openpt(O_RDWR | O_NOCTTY);
-	fds[FDS_PTY].events = POLLIN;
-	unlockpt(fds[FDS_PTY].fd);
-	puts(ptsname(fds[FDS_PTY].fd));
+/* the instruction about to run, with the registers it starts with */
+static void
+trace_insn(Machine *m, int irq)
+{
+	TraceRec r;
+	i8080 *c;
 
-	if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK) != 0){
-		SDL_Log("SDL_Init(): %s", SDL_GetError());
-		exit(EXIT_FAILURE);
+	c = &m->cpu;
+	r.cyc = c->cyc;
+	r.addr = c->pc;
+	r.sp = c->sp;
+	r.banks = m->banks;
+	r.kind = TR_INSN;
+	r.val = irq ? c->interrupt_vector : m->map[c->pc >> 14][c->pc & 0x3fff];
+	r.r[0] = c->b;
+	r.r[1] = c->c;
+	r.r[2] = c->d;
+	r.r[3] = c->e;
+	r.r[4] = c->h;
+	r.r[5] = c->l;
+	r.r[6] = c->sf << 7 | c->zf << 6 | c->hf << 4 | c->pf << 2 | 0x02 | c->cf;
+	r.r[7] = c->a;
+	if(irq){
+		r.kind = TR_IRQ;
+		trace_put(m->trace, &r);
+		r.kind = TR_INSN;
 	}
-	window = SDL_CreateWindow("pac80emu", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, 0);
-	if(window == NULL){
-		SDL_Log("SDL_CreateWindow(): %s", SDL_GetError());
-		exit(EXIT_FAILURE);
+	trace_put(m->trace, &r);
+}
+
+/*
+ * Profiling and tracing step the 8080/ core, whatever the engine, to
+ * see every instruction; cycles are the same on all of them. Halts and
+ * idle loops skipped over count for the instruction waiting.
+ */
+static unsigned long
+watch(Machine *m)
+{
+	i8080 *cpu;
+	unsigned long n;
+	uint64_t cyc;
+	uint32_t at;
+	uint16_t sp;
+
+	cpu = &m->cpu;
+	n = 0;
+	while(cpu->cyc < m->stop){
+		if(cpu->iff && (m->ppi_c & (KINT | VINT | UINT)))
+			i8080_interrupt(cpu, 0xff);
+		if(m->trace)
+			trace_insn(m, cpu->interrupt_pending && cpu->iff && cpu->interrupt_delay == 0);
+		at = bankpc(m, cpu->pc);
+		sp = cpu->sp;
+		cyc = cpu->cyc;
+		i8080_step(cpu);
+		if(!cpu->halted)
+			n++;
+		else if(cpu->cyc < m->stop){
+			m->idle_skip += m->stop - cpu->cyc;
+			cpu->cyc = m->stop;
+		}
+		if(m->prof)
+			prof_insn(m->prof, at, sp, bankpc(m, cpu->pc), cpu->sp, cpu->cyc - cyc);
 	}
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-	if(renderer == NULL){
-		SDL_Log("SDL_CreateRenderer(): %s", SDL_GetError());
-		exit(EXIT_FAILURE);
+	return n;
+}
+
+/* the hot-spot report to path, the folded stacks to path.folded */
+static void
+prof_write(Machine *m)
+{
+	FILE *f;
+	char *s;
+
+	f = fopen(m->prof_path, "w");
+	if(f == NULL){
+		perror(m->prof_path);
+		return;
 	}
-	SDL_RenderSetLogicalSize(renderer, 320, 240);
-	SDL_RenderSetIntegerScale(renderer, SDL_TRUE);
-	SDL_GetRendererInfo(renderer, &info);
-	format = info.texture_formats[0];
-	pixelformat = SDL_AllocFormat(format);
-	p0 = SDL_MapRGB(pixelformat, 0, 0, 0);
-	p1 = SDL_MapRGB(pixelformat, 42, 84, 126);
-	p2 = SDL_MapRGB(pixelformat, 210, 168, 126);
-	SDL_FreeFormat(pixelformat);
-	texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, 320, 240);
-	if(texture == NULL){
-		SDL_Log("SDL_CreateTexture(): %s", SDL_GetError());
-		exit(EXIT_FAILURE);
+	prof_report(m->prof, f, 100);
+	fclose(f);
+	s = malloc(strlen(m->prof_path) + 8);
+	if(s == NULL)
+		return;
+	sprintf(s, "%s.folded", m->prof_path);
+	f = fopen(s, "w");
+	if(f == NULL)
+		perror(s);
+	else{
+		prof_folded(m->prof, f);
+		fclose(f);
 	}
+	free(s);
+}
 
-	want.freq = 44100;
-	want.format = AUDIO_S16SYS;
-	want.channels = 1;
-	want.samples = 128;
-	want.callback = audio_cb;
-	want.userdata = m;
-	audiodev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
-	if(audiodev == 0){
-		SDL_Log("SDL_OpenAudioDevice(): %s", SDL_GetError());
+static void
+prof_start(Machine *m, char *path)
+{
+	m->prof = prof_new();
+	if(m->prof == NULL){
+		perror("prof_new()");
 		exit(EXIT_FAILURE);
 	}
-	m->sng = SNG_new(3146875, have.freq);
-	if(m->sng == NULL){
-		perror("SNG_new()");
+	m->prof_path = path;
+}
+
+static void
+trace_start(Machine *m, char *path)
+{
+	m->trace = trace_open(path);
+	if(m->trace == NULL){
+		perror(path);
 		exit(EXIT_FAILURE);
 	}
-	SNG_set_quality(m->sng, 0);
-	SDL_PauseAudioDevice(audiodev, 0);
+}
 
-	js = NULL;
+static void
+trace_stop(Machine *m)
+{
+	char buf[128];
 
-	fds[FDS_SDL].fd = timerfd_create(CLOCK_MONOTONIC, 0);
-	fds[FDS_SDL].events = POLLIN;
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_nsec = 16666666;
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_nsec = 16666666;
-	timerfd_settime(fds[FDS_SDL].fd, 0, &it, NULL);
+	if(trace_close(m->trace, buf, sizeof(buf)) < 0)
+		fprintf(stderr, "trace: write error\n");
+	puts(buf);
+	m->trace = NULL;
+}
 
-	for(;;){
-		ret = poll(fds, NFDS, -1);
-		if(ret < 0 && errno != EINTR){
-			perror("poll()");
-			exit(EXIT_FAILURE);
-		}
+/* run the CPU up to cycle until, stopping at each pending event */
+static unsigned long
+run(Machine *m, uint64_t until)
+{
+	i8080 *cpu;
+	unsigned long n;
 
-		if(fds[FDS_CPU].revents & POLLIN){
-			ret = read(fds[FDS_CPU].fd, &val, sizeof(val));
-			while(val-- > 0){
-				while(cpu.cyc < 1007){
-					if(cpu.iff && (m->ppi_c & (KINT | VINT | UINT)))
-						i8080_interrupt(&cpu, 0xff);
-					i8080_step(&cpu);
-					if(cpu.halted){
-						cpu.cyc = 1007;
-						break;
-					}
-				}
-				cpu.cyc -= 1007;
-				if(!(m->ppi_c & KIBF) && fifo_count(&m->kb_fifo)){
-					m->ppi_a = fifo_pop(&m->kb_fifo);
-					m->ppi_c |= KIBF;
-					if(m->ppi_c & KINTE)
-						m->ppi_c |= KINT;
-				}
-				m->js_timer++;
-				if(m->js_timer == 5){
-					m->js_timer = 0;
-					m->js_state = 0;
-				}
+	cpu = &m->cpu;
+	n = -m->cf_insns;
+	while(cpu->cyc < until){
+		m->stop = m->next < until ? m->next : until;
+		if(m->prof || m->trace)
+			n += watch(m);
+		while(cpu->cyc < m->stop){
+			if(m->jit)
+				n += jit_run(m->jit, &m->stop, &m->ppi_c, KINT | VINT | UINT);
+			else if(m->dc)
+				n += dc_run(m->dc, &m->stop, &m->ppi_c, KINT | VINT | UINT);
+			else{
+				if(cpu->iff && (m->ppi_c & (KINT | VINT | UINT)))
+					i8080_interrupt(cpu, 0xff);
+				i8080_step(cpu);
+				if(!cpu->halted)
+					n++;
 			}
-		}
-
-		if(fds[FDS_PTY].revents & (POLLERR | POLLHUP)){
-			close(fds[FDS_PTY].fd);
-			fds[FDS_PTY].fd = posix_openpt(O_RDWR | O_NOCTTY);
-			unlockpt(fds[FDS_PTY].fd);
-			puts(ptsname(fds[FDS_PTY].fd));
-		}
-
-		if((m->uart_status & TXRDY) == 0){
-			ret = write(fds[FDS_PTY].fd, &m->uart_tx, 1);
-			m->uart_status |= TXRDY;
-		}
-
-		if(fds[FDS_PTY].revents & POLLIN){
-			ret = read(fds[FDS_PTY].fd, &b, 1);
-			if(ret > 0){
-				fifo_push(&m->uart_fifo, b);
-				if((m->uart_status & RXRDY) == 0){
-					m->uart_rx = fifo_pop(&m->uart_fifo);
-					m->uart_status |= RXRDY;
-					if(m->ppi_c & UINTE)
-						m->ppi_c |= UINT;
-				}
+			if(cpu->halted && cpu->cyc < m->stop){
+				m->idle_skip += m->stop - cpu->cyc;
+				cpu->cyc = m->stop;
 			}
 		}
+		if(cpu->cyc >= m->next)
+			dispatch(m);
+	}
+	if(m->trace)
+		trace_sync(m->trace);
+	return n + m->cf_insns;
+}
 
-		if(fds[FDS_SDL].revents & POLLIN){
-			ret = read(fds[FDS_SDL].fd, &val, sizeof(val));
-
-			if(m->ppi_c & VINTE)
-				m->ppi_c |= VINT;
-
-			while(SDL_PollEvent(&event)){
-				if(event.type == SDL_KEYDOWN){
-					fifo_push(&m->kb_fifo, xlat[event.key.keysym.scancode]);
-				}else if(event.type == SDL_KEYUP){
-					fifo_push(&m->kb_fifo, xlat[event.key.keysym.scancode] | 0x80);
-				}else if(event.type == SDL_JOYBUTTONDOWN){
-					if(event.jbutton.button < sizeof(js_map) / sizeof(js_map[0]))
-						 m->js_buttons |= js_map[event.jbutton.button];
-				}else if(event.type == SDL_JOYBUTTONUP){
-					if(event.jbutton.button < sizeof(js_map) / sizeof(js_map[0]))
-						 m->js_buttons &= ~js_map[event.jbutton.button];
-				}else if(event.type == SDL_JOYHATMOTION){
-					m->js_buttons &= ~(BUTTON_U | BUTTON_D | BUTTON_L | BUTTON_R);
-					if(event.jhat.value & SDL_HAT_UP)
-						 m->js_buttons |= BUTTON_U;
-					if(event.jhat.value & SDL_HAT_DOWN)
-						 m->js_buttons |= BUTTON_D;
-					if(event.jhat.value & SDL_HAT_LEFT)
-						 m->js_buttons |= BUTTON_L;
-					if(event.jhat.value & SDL_HAT_RIGHT)
-						 m->js_buttons |= BUTTON_R;
-				}else if(event.type == SDL_JOYDEVICEADDED && js == NULL){
-					guid = SDL_JoystickGetDeviceGUID(event.jdevice.which);
-					if(memcmp(js_guid, &guid, sizeof(js_guid)) == 0){
-						js = SDL_JoystickOpen(event.jdevice.which);
-						if(js == NULL)
-							SDL_Log("SDL_JoystickOpen(): %s", SDL_GetError());
-					}
-				}else if(event.type == SDL_JOYDEVICEREMOVED && js != NULL){
-					SDL_JoystickClose(js);
-					js = NULL;
-				}else if(event.type == SDL_QUIT){
-					messageboxdata.flags = 0;
-					messageboxdata.window = NULL;
-					messageboxdata.title = "Dialog";
-					messageboxdata.message = "Leave?";
-					messageboxdata.numbuttons = 3;
-					buttons[0].flags = SDL_MESSAGEBOX_BUTTON_RETURNKEY_DEFAULT;
-					buttons[0].buttonid = 0;
-					buttons[0].text = "Quit";
-					buttons[1].flags = 0;
-					buttons[1].buttonid = 1;
-					buttons[1].text = "Reset";
-					buttons[2].flags = SDL_MESSAGEBOX_BUTTON_ESCAPEKEY_DEFAULT;
-					buttons[2].buttonid = 2;
-					buttons[2].text = "Cancel";
-					messageboxdata.buttons = buttons;
-					messageboxdata.colorScheme = NULL;
-					timerfd_settime(fds[FDS_CPU].fd, 0, &stop, &it);
-					ret = SDL_ShowMessageBox(&messageboxdata, &buttonid);
-					timerfd_settime(fds[FDS_CPU].fd, 0, &it, NULL);
-					if(ret != 0 || buttonid == 0){
-						break;
-					}else if(buttonid == 1){
-						reset(m);
-						cpu.pc = 0;
-						cpu.iff = 0;
-						cpu.halted = 0;
-						cpu.interrupt_pending = 0;
-					}
-				}
-			}
-			if(event.type == SDL_QUIT && buttonid == 0)
-				break;
+static void
+kbd_push(Machine *m, uint8_t b)
+{
+	if(m->rec)
+		rec_put(m, IN_KBD, b);
+	fifo_push(&m->kb_fifo, b);
+	if(!(m->ppi_c & KIBF) && m->ev[EV_KBD] == NEVER)
+		schedule(m, EV_KBD, m->cpu.cyc + KBD_CYCLES);
+}
 
-			SDL_LockTexture(texture, NULL, (void **)&pixels, &pitch);
-			plane = m->ram + ((m->ppi_c & VA15) ? 0x19810 : 0x11810);
-			for(y = 0; y < 240; y++)
-				for(x = 0, src = plane + y; x < 320; x += 8, src += 0x100)
-					for(b = 0x80; b != 0; b >>= 1)
-						*pixels++ = (*src & b) ? p1 : p0;
-			SDL_UnlockTexture(texture);
-			SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_NONE);
-			SDL_RenderCopy(renderer, texture, NULL, NULL);
+/*
+ * Read what the host has into the receive ring, stopping when it is
+ * full: the rest waits in the kernel rather than being dropped.
+ */
+static void
+uart_recv(Machine *m)
+{
+	Ring *r;
+	uint32_t n;
+	ssize_t ret;
 
-			SDL_LockTexture(texture, NULL, (void **)&pixels, &pitch);
-			plane = m->ram + ((m->ppi_c & VA15) ? 0x1d810 : 0x15810);
-			for(y = 0; y < 240; y++)
-				for(x = 0, src = plane + y; x < 320; x += 8, src += 0x100)
-					for(b = 0x80; b != 0; b >>= 1)
-						*pixels++ = (*src & b) ? p2 : p0;
-			SDL_UnlockTexture(texture);
-			SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_ADD);
-			SDL_RenderCopy(renderer, texture, NULL, NULL);
-			SDL_RenderPresent(renderer);
+	r = &m->uart_in;
+	while(m->uart_fd >= 0 && ring_space(r)){
+		n = UART_RING - (r->head & (UART_RING - 1));
+		if(n > ring_space(r))
+			n = ring_space(r);
+		ret = read(m->uart_fd, r->buf + (r->head & (UART_RING - 1)), n);
+		if(ret > 0){
+			for(n = 0; m->rec && n < ret; n++)
+				rec_put(m, IN_UART, r->buf[(r->head + n) & (UART_RING - 1)]);
+			r->head += ret;
+			continue;
 		}
+		if(ret == 0 && m->uart_lfd >= 0)
+			uart_hangup(m);
+		else if(ret == 0)
+			m->uart_eof = 1;
+		break;
+	}
+	uart_fill(m);
+}
+
+static void
+resync(Machine *m)
+{
+	int i;
+
+	m->next = NEVER;
+	for(i = 0; i < NEV; i++)
+		if(m->ev[i] < m->next)
+			m->next = m->ev[i];
+	m->stop = 0;
+	m->idle_pc = -1;
+	m->cf_buf = (m->cf_status & 0x08) ? cf_sector(m->cf, m->cf_lba, m->cf_cmd == 0x30) : NULL;
+	if(m->audio)
+		m->audio->pos = (uint64_t)m->cpu.cyc << 16;
+}
+
+/*
+ * Snapshot file: magic and version, then records of tagged chunks
+ * (4-byte tag, 32-bit length), each record closed by an END chunk. A
+ * full record holds every RAM page; an incremental one appended after
+ * it only the pages written since the previous save. Loading replays
+ * every complete record in order. The CF image is not included; keep
+ * it unchanged or pair the snapshot with an overlay.
+ */
+static uint8_t *
+le_put(uint8_t *p, uint64_t v, int n)
+{
+	while(n-- > 0){
+		*p++ = v;
+		v >>= 8;
+	}
+	return p;
+}
+
+static uint64_t
+le_get(uint8_t **pp, int n)
+{
+	uint64_t v;
+	int i;
+
+	v = 0;
+	for(i = 0; i < n; i++)
+		v |= (uint64_t)(*pp)[i] << (i * 8);
+	*pp += n;
+	return v;
+}
+
+/* serialise a field into p, or back out of it */
+#define F(x, n) do{ if(load) (x) = le_get(&p, (n)); else p = le_put(p, (x), (n)); }while(0)
+
+static uint8_t *
+snap_cpu(Machine *m, uint8_t *p, int load)
+{
+	i8080 *c;
+
+	c = &m->cpu;
+	F(c->cyc, 8);
+	F(c->pc, 2);
+	F(c->sp, 2);
+	F(c->a, 1);
+	F(c->b, 1);
+	F(c->c, 1);
+	F(c->d, 1);
+	F(c->e, 1);
+	F(c->h, 1);
+	F(c->l, 1);
+	F(c->sf, 1);
+	F(c->zf, 1);
+	F(c->hf, 1);
+	F(c->pf, 1);
+	F(c->cf, 1);
+	F(c->iff, 1);
+	F(c->halted, 1);
+	F(c->interrupt_pending, 1);
+	F(c->interrupt_vector, 1);
+	F(c->interrupt_delay, 1);
+	return p;
+}
+
+static uint8_t *
+snap_fifo(FIFO *f, uint8_t *p, int load)
+{
+	int i;
+
+	F(f->head, 2);
+	F(f->tail, 2);
+	for(i = 0; i < sizeof(f->buf); i++)
+		F(f->buf[i], 1);
+	return p;
+}
+
+static uint8_t *
+snap_bank(Machine *m, uint8_t *p, int load)
+{
+	uint8_t page;
+	int i;
+
+	for(i = 0; i < 4; i++){
+		page = m->map[i] == m->rom ? 0xf : (m->map[i] - m->ram) >> 14;
+		F(page, 1);
+		if(load)
+			setmap(m, i, page);
+	}
+	return p;
+}
+
+static uint8_t *
+snap_uart(Machine *m, uint8_t *p, int load)
+{
+	F(m->uart_rx, 1);
+	F(m->uart_tx, 1);
+	F(m->uart_status, 1);
+	F(m->uart_rxt, 8);
+	return snap_fifo(&m->uart_fifo, p, load);
+}
+
+static uint8_t *
+snap_cf(Machine *m, uint8_t *p, int load)
+{
+	F(m->cf_scount, 2);
+	F(m->cf_bcount, 2);
+	F(m->cf_lba, 4);
+	F(m->cf_status, 1);
+	F(m->cf_cmd, 1);
+	return p;
+}
+
+static uint8_t *
+snap_ppi(Machine *m, uint8_t *p, int load)
+{
+	F(m->ppi_a, 1);
+	F(m->ppi_b, 1);
+	F(m->ppi_c, 1);
+	p = snap_fifo(&m->kb_fifo, p, load);
+	F(m->js_buttons, 2);
+	F(m->js_state, 1);
+	return p;
+}
+
+/* an open file is not kept */
+static uint8_t *
+snap_host(Machine *m, uint8_t *p, int load)
+{
+	F(m->host_addr, 2);
+	F(m->host_count, 2);
+	F(m->host_status, 1);
+	F(m->host_ctrl, 1);
+	F(m->ext_irq, 1);
+	if(load && m->host_fd >= 0){
+		close(m->host_fd);
+		m->host_fd = -1;
+	}
+	return p;
+}
+
+static uint8_t *
+snap_mach(Machine *m, uint8_t *p, int load)
+{
+	int i;
+
+	for(i = 0; i < NEV; i++)
+		F(m->ev[i], 8);
+	F(m->frame, 8);
+	for(i = 0; i < ndevices; i++)
+		if(devices[i]->tag == NULL && devices[i]->snap)
+			p = devices[i]->snap(m, p, load);
+	return p;
+}
+
+/* the chip state, but not the host sample rate it was created for */
+static uint8_t *
+snap_psg(Machine *m, uint8_t *p, int load)
+{
+	SNG *s;
+	int i;
+
+	s = m->sng;
+	F(s->out, 4);
+	for(i = 0; i < 3; i++){
+		F(s->count[i], 4);
+		F(s->volume[i], 4);
+		F(s->freq[i], 4);
+		F(s->edge[i], 4);
+		F(s->mute[i], 4);
+	}
+	F(s->noise_seed, 4);
+	F(s->noise_count, 4);
+	F(s->noise_freq, 4);
+	F(s->noise_volume, 4);
+	F(s->noise_mode, 4);
+	F(s->noise_fref, 4);
+	F(s->base_count, 4);
+	F(s->sngtime, 4);
+	F(s->adr, 4);
+	F(s->stereo, 4);
+	for(i = 0; i < 4; i++)
+		F(s->ch_out[i], 2);
+	return p;
+}
+
+#undef F
+
+/* the devices with a tag of their own are added by attach() */
+static struct{
+	char *tag;
+	uint8_t *(*fn)(Machine *, uint8_t *, int);
+} snaptab[2 + 8] = {
+	{"CPU ", snap_cpu},
+	{"MACH", snap_mach},
+};
+static int nsnap = 2;
+
+static Device bank_dev = {"BANK", 0x08, 6, 3, 0x00, bank_in, bank_out, bank_reset, NULL, snap_bank};
+static Device uart_dev = {"UART", 0x28, 0, 1, 0x02, uart_in, uart_out, uart_reset, NULL, snap_uart};
+static Device cf_dev = {"CF", 0x30, 0, 7, 0x00, cf_in, cf_out, cf_reset, NULL, snap_cf, 1};
+static Device ppi_dev = {"PPI", 0x18, 0, 7, 0x50, ppi_in, ppi_out, ppi_reset, NULL, snap_ppi};	/* port C */
+static Device psg_dev = {"PSG", 0x38, 0, 0, 0x00, NULL, psg_out, NULL, "PSG ", snap_psg};
+static Device host_dev = {"HOST", 0x00, 0, 7, 0x00, host_in, host_out, host_reset, "HOST", snap_host, 1};	/* EXT0 */
+
+/* plug d into the bus, replacing whatever answered its select */
+static void
+attach(Device *d)
+{
+	Port *p;
+	int i;
+
+	devices[ndevices++] = d;
+	if(d->tag){
+		snaptab[nsnap].tag = d->tag;
+		snaptab[nsnap].fn = d->snap;
+		nsnap++;
+	}
+	for(i = 0; i < 256; i++){
+		if((i & 0x38) != d->sel)
+			continue;
+		p = &bus[i];
+		p->in = d->in ? d->in : none_in;
+		p->out = d->out ? d->out : none_out;
+		p->dev = d;
+		p->reg = (i >> d->shift) & d->mask;
+		p->idle = (d->idle >> p->reg) & 1;
+	}
+}
+
+/* the devices of the Pacific80 board; EXT0-EXT2 stay empty */
+static void
+bus_init(void)
+{
+	int i;
+
+	for(i = 0; i < 256; i++){
+		bus[i].in = none_in;
+		bus[i].out = none_out;
+	}
+	attach(&bank_dev);
+	attach(&uart_dev);
+	attach(&cf_dev);
+	attach(&ppi_dev);
+	attach(&psg_dev);
+}
+
+static int
+snap_chunk(FILE *f, const char *tag, uint8_t *data, uint32_t len)
+{
+	uint8_t hdr[8];
+
+	memcpy(hdr, tag, 4);
+	le_put(hdr + 4, len, 4);
+	if(fwrite(hdr, sizeof(hdr), 1, f) != 1 || (len > 0 && fwrite(data, len, 1, f) != 1))
+		return -1;
+	return 0;
+}
+
+/*
+ * Save a snapshot. With incremental set and a previous save or load in
+ * this session, append a record of what changed since; otherwise
+ * write the whole machine to a new file.
+ */
+static int
+snap_save(Machine *m, char *path, int incremental)
+{
+	uint8_t buf[1024], *p, *run;
+	uint32_t len, crc;
+	FILE *f;
+	int i, j, n, full;
+
+	if(m->audio)
+		psg_sync(m);
+	full = !incremental || !m->snap_base;
+	f = fopen(path, full ? "wb" : "ab");
+	if(f == NULL)
+		return -1;
+	if(full){
+		memcpy(buf, SNAP_MAGIC, 8);
+		le_put(buf + 8, SNAP_VERSION, 4);
+		crc = crc32(0, m->rom, 16 * 1024);
+		le_put(buf + 12, crc, 4);
+		le_put(buf + 16, m->cf_size, 8);
+		if(fwrite(buf, 24, 1, f) != 1)
+			goto fail;
+	}
+	for(i = 0; i < nsnap; i++){
+		p = snaptab[i].fn(m, buf, 0);
+		if(snap_chunk(f, snaptab[i].tag, buf, p - buf) < 0)
+			goto fail;
+	}
+
+	/* runs of pages: first page, count, data */
+	len = 0;
+	for(i = 0; i < 1024; i = j){
+		for(; i < 1024 && !full && !(m->dirty[i] & DIRTY_SNAP); i++)
+			;
+		for(j = i; j < 1024 && (full || (m->dirty[j] & DIRTY_SNAP)); j++)
+			;
+		if(j > i)
+			len += 4 + (j - i) * 256;
+	}
+	memcpy(buf, "RAM ", 4);
+	le_put(buf + 4, len, 4);
+	if(fwrite(buf, 8, 1, f) != 1)
+		goto fail;
+	for(i = 0; i < 1024; i = j){
+		for(; i < 1024 && !full && !(m->dirty[i] & DIRTY_SNAP); i++)
+			;
+		for(j = i; j < 1024 && (full || (m->dirty[j] & DIRTY_SNAP)); j++)
+			m->dirty[j] &= ~DIRTY_SNAP;
+		if(j == i)
+			continue;
+		n = j - i;
+		run = m->ram + i * 256;
+		le_put(buf, i, 2);
+		le_put(buf + 2, n, 2);
+		if(fwrite(buf, 4, 1, f) != 1 || fwrite(run, n * 256, 1, f) != 1)
+			goto fail;
+	}
+	if(snap_chunk(f, "END ", NULL, 0) < 0)
+		goto fail;
+	if(fclose(f) != 0)
+		return -1;
+	m->snap_base = 1;
+	return 0;
+fail:
+	fclose(f);
+	return -1;
+}
+
+static int
+snap_load(Machine *m, char *path)
+{
+	uint8_t tmp[1024], *buf, *tag, *p, *q, *end, *last;
+	uint32_t len, first, n;
+	long size;
+	FILE *f;
+	int i;
+
+	f = fopen(path, "rb");
+	if(f == NULL)
+		return -1;
+	buf = NULL;
+	if(fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+		goto fail;
+	buf = malloc(size + 1);
+	if(buf == NULL || fread(buf, 1, size, f) != size)
+		goto fail;
+	fclose(f);
+	f = NULL;
+	errno = EINVAL;
+	p = buf + 8;
+	if(size < 24 || memcmp(buf, SNAP_MAGIC, 8) != 0 || le_get(&p, 4) != SNAP_VERSION)
+		goto fail;
+	if(le_get(&p, 4) != crc32(0, m->rom, 16 * 1024) || le_get(&p, 8) != m->cf_size)
+		goto fail;
+
+	/* only replay up to the last complete record */
+	end = buf + size;
+	last = NULL;
+	for(p = buf + 24; end - p >= 8; p += len){
+		tag = p;
+		p += 4;
+		len = le_get(&p, 4);
+		if(len > end - p)
+			break;
+		if(memcmp(tag, "END ", 4) == 0)
+			last = p;
+	}
+	if(last == NULL)
+		goto fail;
+
+	for(p = buf + 24; p < last; p += len){
+		tag = p;
+		p += 4;
+		len = le_get(&p, 4);
+		for(i = 0; i < nsnap; i++)
+			if(memcmp(tag, snaptab[i].tag, 4) == 0 && snaptab[i].fn(m, tmp, 0) - tmp == len)
+				snaptab[i].fn(m, p, 1);
+		if(memcmp(tag, "RAM ", 4) != 0)
+			continue;
+		for(q = p, end = p + len; end - q >= 4; q += n * 256){
+			first = le_get(&q, 2);
+			n = le_get(&q, 2);
+			if(first + n > 1024 || n * 256 > end - q)
+				break;
+			memcpy(m->ram + first * 256, q, n * 256);
+		}
+	}
+	free(buf);
+
+	resync(m);
+	if(m->jit)
+		jit_flush(m->jit);
+	memset(m->dirty, 0xff & ~DIRTY_SNAP, sizeof(m->dirty));
+	return 0;
+fail:
+	i = errno;
+	if(f)
+		fclose(f);
+	free(buf);
+	errno = i;
+	return -1;
+}
+
+/*
+ * Rewind: at every VINT the state chunks and an XOR delta of the RAM
+ * pages written since the previous VINT go into a ring of fixed size,
+ * the oldest frames dropped to make room. Deltas are run-length coded
+ * as (zeros, literals) byte pairs per page. Stepping back XORs the
+ * newest delta out of RAM and loads the state before it.
+ */
+static int
+rle_xor(uint8_t *out, uint8_t *cur, uint8_t *old)
+{
+	int i, z, n, len;
+
+	len = 0;
+	for(i = 0; i < 256; i += n){
+		for(z = 0; i < 256 && z < 255 && cur[i] == old[i]; z++, i++)
+			;
+		for(n = 0; i + n < 256 && n < 255 && cur[i + n] != old[i + n]; n++)
+			out[len + 2 + n] = cur[i + n] ^ old[i + n];
+		out[len] = z;
+		out[len + 1] = n;
+		len += 2 + n;
+	}
+	memcpy(old, cur, 256);
+	return len;
+}
+
+static void
+rle_unxor(uint8_t *p, int len, uint8_t *cur, uint8_t *old)
+{
+	uint8_t *end;
+	int i, n;
+
+	end = p + len;
+	for(i = 0; p < end;){
+		i += *p++;
+		n = *p++;
+		while(n-- > 0){
+			cur[i] ^= *p;
+			old[i++] ^= *p++;
+		}
+	}
+}
+
+static Rewind *
+rewind_new(Machine *m, size_t size)
+{
+	Rewind *r;
+	int i;
+
+	r = calloc(1, sizeof(Rewind));
+	if(r == NULL)
+		return NULL;
+	r->size = size > REWIND_REC ? size : REWIND_REC;
+	r->buf = malloc(r->size);
+	r->scratch = malloc(REWIND_REC);
+	if(r->buf == NULL || r->scratch == NULL){
+		free(r->buf);
+		free(r->scratch);
+		free(r);
+		return NULL;
+	}
+	memcpy(r->ram, m->ram, sizeof(r->ram));
+	for(i = 0; i < 1024; i++)
+		m->dirty[i] &= ~DIRTY_REWIND;
+	return r;
+}
+
+/* contiguous room for len bytes, dropping the oldest frames */
+static uint8_t *
+rewind_alloc(Rewind *r, size_t len)
+{
+	size_t s, e, off;
+
+	for(;;){
+		if(r->n == 0){
+			off = 0;
+			break;
+		}
+		s = r->rec[r->first].off;
+		e = r->rec[(r->first + r->n - 1) % REWIND_MAX].off + r->rec[(r->first + r->n - 1) % REWIND_MAX].len;
+		if(r->n < REWIND_MAX){
+			if(s < e && r->size - e >= len){
+				off = e;
+				break;
+			}
+			if(s < e && s >= len){
+				off = 0;
+				break;
+			}
+			if(e <= s && s - e >= len){
+				off = e;
+				break;
+			}
+		}
+		r->used -= r->rec[r->first].len;
+		r->first = (r->first + 1) % REWIND_MAX;
+		r->n--;
+	}
+	r->rec[(r->first + r->n) % REWIND_MAX].off = off;
+	r->rec[(r->first + r->n) % REWIND_MAX].len = len;
+	r->n++;
+	r->used += len;
+	return r->buf + off;
+}
+
+static void
+rewind_capture(Machine *m)
+{
+	Rewind *r;
+	struct timespec t0, t1;
+	uint8_t *p, *q;
+	uint64_t ns;
+	int i, len;
+
+	r = m->rewind;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	p = r->scratch + 2;
+	for(i = 0; i < nsnap; i++)
+		p = snaptab[i].fn(m, p, 0);
+	le_put(r->scratch, p - r->scratch - 2, 2);
+	for(i = 0; i < 1024; i++){
+		if(!(m->dirty[i] & DIRTY_REWIND))
+			continue;
+		m->dirty[i] &= ~DIRTY_REWIND;
+		if(memcmp(m->ram + i * 256, r->ram + i * 256, 256) == 0)
+			continue;
+		len = rle_xor(p + 4, m->ram + i * 256, r->ram + i * 256);
+		le_put(p, i, 2);
+		le_put(p + 2, len, 2);
+		p += 4 + len;
+	}
+	q = rewind_alloc(r, p - r->scratch);
+	memcpy(q, r->scratch, p - r->scratch);
+	r->rec[(r->first + r->n - 1) % REWIND_MAX].cyc = m->cpu.cyc;
+	r->frames++;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	r->ns += ns;
+	if(ns > r->maxns)
+		r->maxns = ns;
+}
+
+static void
+rewind_report(Rewind *r, char *buf, size_t len)
+{
+	snprintf(buf, len, "rewind: %d frames held, %zu of %zu KB, capture %.1f us avg, %.1f us max",
+		r->n, r->used >> 10, r->size >> 10,
+		r->frames ? r->ns / 1e3 / r->frames : 0.0, r->maxns / 1e3);
+}
+
+/*
+ * Go back to the newest frame, or to the one before it when already
+ * there. Returns -1 when there is nothing older left.
+ */
+static int
+rewind_step(Machine *m)
+{
+	Rewind *r;
+	uint8_t *p, *end;
+	int i, k, page, len;
+
+	r = m->rewind;
+	if(r->n == 0)
+		return -1;
+	for(i = 0; i < 1024; i++){
+		if(!(m->dirty[i] & DIRTY_REWIND))
+			continue;
+		if(memcmp(m->ram + i * 256, r->ram + i * 256, 256) != 0){
+			memcpy(m->ram + i * 256, r->ram + i * 256, 256);
+			m->dirty[i] = 0xff;
+		}
+		m->dirty[i] &= ~DIRTY_REWIND;
+	}
+	k = (r->first + r->n - 1) % REWIND_MAX;
+	if(m->cpu.cyc == r->rec[k].cyc){
+		if(r->n == 1)
+			return -1;
+		p = r->buf + r->rec[k].off;
+		end = p + r->rec[k].len;
+		for(p += 2 + (p[0] | p[1] << 8); p < end; p += len){
+			page = le_get(&p, 2);
+			len = le_get(&p, 2);
+			rle_unxor(p, len, m->ram + page * 256, r->ram + page * 256);
+			m->dirty[page] = 0xff & ~DIRTY_REWIND;
+		}
+		r->used -= r->rec[k].len;
+		r->n--;
+		k = (r->first + r->n - 1) % REWIND_MAX;
+	}
+	p = r->buf + r->rec[k].off + 2;
+	for(i = 0; i < nsnap; i++)
+		p = snaptab[i].fn(m, p, 1);
+	resync(m);
+	if(m->jit)
+		jit_flush(m->jit);
+	return 0;
+}
+
+/*
+ * Run-ahead: after each real frame, save the state, run some frames
+ * more with the same inputs, show the last of them and go back, which
+ * hides that many frames of the guest's own input lag. RAM is saved in
+ * a copy kept up to date from the pages real frames write, DIRTY_AHEAD
+ * marking the pages that differ from it. Ahead, writes to devices with
+ * effects outside the machine are held back, and nothing is recorded,
+ * profiled, sent to the host or played.
+ */
+static Ahead *
+ahead_new(Machine *m, int frames)
+{
+	Ahead *a;
+	int i;
+
+	a = calloc(1, sizeof(Ahead));
+	if(a == NULL)
+		return NULL;
+	a->frames = frames;
+	memcpy(a->ram, m->ram, sizeof(a->ram));
+	for(i = 0; i < 1024; i++)
+		m->dirty[i] &= ~DIRTY_AHEAD;
+	return a;
+}
+
+/* save the real frame and run ahead of it to frame */
+static void
+ahead_go(Machine *m, uint64_t frame)
+{
+	Ahead *a;
+	uint8_t *p;
+	int i;
+
+	a = m->ahead;
+	a->t0 = pool_now();
+	for(i = 0; i < 1024; i++){
+		if(m->dirty[i] & DIRTY_AHEAD){
+			memcpy(a->ram + i * 256, m->ram + i * 256, 256);
+			m->dirty[i] &= ~DIRTY_AHEAD;
+		}
+	}
+	p = a->state;
+	for(i = 0; i < nsnap; i++)
+		p = snaptab[i].fn(m, p, 0);
+	a->tx = m->uart_out.head;
+	a->rx = m->uart_in.tail;
+	a->prompt_at = m->prompt_at;
+	a->idle_skip = m->idle_skip;
+	a->audio = m->audio;
+	a->prof = m->prof;
+	a->trace = m->trace;
+	m->audio = NULL;
+	m->prof = NULL;
+	m->trace = NULL;
+	m->speculative = 1;
+	run(m, frame * CPU_HZ / 60);
+}
+
+/* back to the real frame */
+static void
+ahead_back(Machine *m)
+{
+	Ahead *a;
+	uint8_t *p;
+	uint64_t ns;
+	int i, fd;
+
+	a = m->ahead;
+	for(i = 0; i < 1024; i++){
+		if(!(m->dirty[i] & DIRTY_AHEAD))
+			continue;
+		m->dirty[i] &= ~DIRTY_AHEAD;
+		if(memcmp(m->ram + i * 256, a->ram + i * 256, 256) == 0)
+			continue;
+		memcpy(m->ram + i * 256, a->ram + i * 256, 256);
+		m->dirty[i] = 0xff & ~DIRTY_AHEAD;
+		if(m->jit)
+			jit_restore(m->jit, i << 8);
+	}
+	/* HOST OUTs were held back, so its file is where it was: keep it open */
+	fd = m->host_fd;
+	m->host_fd = -1;
+	p = a->state;
+	for(i = 0; i < nsnap; i++)
+		p = snaptab[i].fn(m, p, 1);
+	m->host_fd = fd;
+	m->uart_out.head = a->tx;
+	m->uart_in.tail = a->rx;
+	m->prompt_at = a->prompt_at;
+	m->idle_skip = a->idle_skip;
+	m->speculative = 0;
+	resync(m);
+	m->audio = a->audio;
+	m->prof = a->prof;
+	m->trace = a->trace;
+	ns = pool_now() - a->t0;
+	a->n++;
+	a->ns += ns;
+	if(ns > a->maxns)
+		a->maxns = ns;
+}
+
+static void
+ahead_report(Ahead *a, char *buf, size_t len)
+{
+	snprintf(buf, len, "run-ahead: %d frames, %.1f us avg, %.1f us max a frame, %lu OUTs held back",
+		a->frames, a->n ? a->ns / 1e3 / a->n : 0.0, a->maxns / 1e3, a->held);
+}
+
+/* a key went down at host time t0, if no other is being timed */
+static void
+lat_key(Machine *m, uint8_t code, uint64_t t0)
+{
+	Latency *l;
+
+	l = m->lat;
+	if(l->state != 0 && t0 - l->t0 < 1000000000ULL)
+		return;
+	l->code = code;
+	l->t0 = t0;
+	l->cyc = m->cpu.cyc;
+	l->state = 1;
+}
+
+/* a frame showing the key read k was presented */
+static void
+lat_shown(Latency *l, KeyRead *k)
+{
+	uint64_t t;
+
+	t = pool_now();
+	l->n++;
+	l->read += k->t1 - k->t0;
+	l->shown += t - k->t0;
+	if(t - k->t0 > l->maxshown)
+		l->maxshown = t - k->t0;
+	SDL_Log("latency: key %02X read after %.1f ms, shown after %.1f ms", k->code,
+		(k->t1 - k->t0) / 1e6, (t - k->t0) / 1e6);
+}
+
+static void
+lat_report(Latency *l, char *buf, size_t len)
+{
+	snprintf(buf, len, "latency: %lu keys, read after %.1f ms (%.0f cycles), shown after %.1f ms avg, %.1f ms max",
+		l->n, l->n ? l->read / 1e6 / l->n : 0.0, l->n ? (double)l->cycles / l->n : 0.0,
+		l->n ? l->shown / 1e6 / l->n : 0.0, l->maxshown / 1e6);
+}
+
+/*
+ * Input recording: every scancode, joystick change, received UART byte
+ * and reset, with the cycle it reached the machine at, after a header
+ * with the starting cycle and the CRC of RAM. Replay runs headless and
+ * stops run() at each recorded cycle to inject the input there; a
+ * machine whose timeline does not depend on where run() stops then
+ * goes through the same states.
+ */
+static uint32_t
+ramcrc(Machine *m)
+{
+	return crc32(0, m->ram, SINK);
+}
+
+static void
+rec_put(Machine *m, uint8_t kind, uint32_t val)
+{
+	uint8_t buf[INPUT_LEN];
+
+	memset(buf, 0, sizeof(buf));
+	le_put(buf, m->cpu.cyc, 8);
+	buf[8] = kind;
+	le_put(buf + 12, val, 4);
+	if(fwrite(buf, 1, sizeof(buf), m->rec) != sizeof(buf))
+		perror("fwrite()");
+}
+
+static void
+rec_open(Machine *m, char *path)
+{
+	uint8_t buf[24], *p;
+
+	m->rec = fopen(path, "wb");
+	if(m->rec == NULL){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(buf, INPUT_MAGIC, 8);
+	p = le_put(buf + 8, m->cpu.cyc, 8);
+	p = le_put(p, ramcrc(m), 4);
+	le_put(p, 0, 4);
+	if(fwrite(buf, 1, sizeof(buf), m->rec) != sizeof(buf)){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	m->rec_js = m->js_buttons;
+}
+
+static void
+rec_close(Machine *m)
+{
+	rec_put(m, IN_END, ramcrc(m));
+	if(fclose(m->rec) != 0)
+		perror("fclose()");
+	m->rec = NULL;
+}
+
+static void
+play_open(Machine *m, char *path)
+{
+	uint8_t buf[24], *p;
+	uint64_t start;
+	uint32_t crc;
+	FILE *f;
+	size_t n;
+
+	f = fopen(path, "rb");
+	if(f == NULL || fread(buf, 1, sizeof(buf), f) != sizeof(buf) || memcmp(buf, INPUT_MAGIC, 8) != 0){
+		fprintf(stderr, "%s: not an input recording\n", path);
+		exit(EXIT_FAILURE);
+	}
+	p = buf + 8;
+	start = le_get(&p, 8);
+	crc = le_get(&p, 4);
+	if(start != m->cpu.cyc || crc != ramcrc(m))
+		fprintf(stderr, "%s: recorded from another state (cycle %llu)\n", path, (unsigned long long)start);
+	m->nplay = 0;
+	m->played = 0;
+	m->late = 0;
+	for(n = 1024; (m->play = realloc(m->play, n * sizeof(Input))) != NULL; n *= 2){
+		while(m->nplay < n && fread(buf, 1, INPUT_LEN, f) == INPUT_LEN){
+			p = buf;
+			m->play[m->nplay].cyc = le_get(&p, 8);
+			m->play[m->nplay].kind = buf[8];
+			p = buf + 12;
+			m->play[m->nplay].val = le_get(&p, 4);
+			m->nplay++;
+		}
+		if(m->nplay < n)
+			break;
+	}
+	if(m->play == NULL){
+		perror("realloc()");
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+}
+
+/* cycle of the next input to replay */
+static uint64_t
+play_next(Machine *m)
+{
+	return m->played < m->nplay ? m->play[m->played].cyc : NEVER;
+}
+
+/* inject the inputs due by now; the final CRC is checked by play_report() */
+static void
+play_due(Machine *m)
+{
+	Input *in;
+	Ring *r;
+
+	for(; m->played < m->nplay && m->play[m->played].cyc <= m->cpu.cyc; m->played++){
+		in = &m->play[m->played];
+		if(in->cyc != m->cpu.cyc)
+			m->late++;
+		switch(in->kind){
+		case IN_KBD:
+			kbd_push(m, in->val);
+			break;
+		case IN_JS:
+			m->js_buttons = in->val;
+			break;
+		case IN_UART:
+			r = &m->uart_in;
+			if(ring_space(r))
+				r->buf[r->head++ & (UART_RING - 1)] = in->val;
+			uart_fill(m);
+			break;
+		case IN_RESET:
+			reset(m);
+			break;
+		case IN_END:
+			return;
+		}
+	}
+}
+
+static void
+play_report(Machine *m)
+{
+	Input *end;
+
+	end = m->nplay > 0 && m->play[m->nplay - 1].kind == IN_END ? &m->play[m->nplay - 1] : NULL;
+	printf("replay: %zu of %zu inputs, %lu late", m->played, m->nplay, m->late);
+	if(end && m->cpu.cyc == end->cyc)
+		printf(", RAM %s the recording\n", ramcrc(m) == end->val ? "matches" : "differs from");
+	else if(end)
+		printf(", stopped at cycle %llu before the end at %llu\n",
+			(unsigned long long)m->cpu.cyc, (unsigned long long)end->cyc);
+	else
+		printf(", no end recorded\n");
+}
+
+
+/* accept a client on the socket endpoint, then move data both ways */
+static void
+uart_io(Machine *m)
+{
+	if(m->uart_fd < 0 && m->uart_lfd >= 0)
+		m->uart_fd = accept4(m->uart_lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	uart_send(m);
+	uart_recv(m);
+}
+
+/* what to wait for on the serial line */
+static void
+uart_poll(Machine *m, struct pollfd *pfd)
+{
+	if(m->uart_fd < 0){
+		pfd->fd = m->uart_lfd;
+		pfd->events = POLLIN;
+		return;
+	}
+	pfd->fd = m->uart_fd;
+	pfd->events = (ring_space(&m->uart_in) ? POLLIN : 0) | (ring_count(&m->uart_out) ? POLLOUT : 0);
+}
+
+/*
+ * Open the host end of the serial line: a pty, or a unix socket taking
+ * one client at a time. Returns the name to print.
+ */
+static char *
+uart_open(Machine *m, char *path)
+{
+	struct sockaddr_un sa;
+
+	m->uart_lfd = -1;
+	if(path == NULL){
+		m->uart_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if(m->uart_fd < 0 || unlockpt(m->uart_fd) < 0){
+			perror("posix_openpt()");
+			exit(EXIT_FAILURE);
+		}
+		return ptsname(m->uart_fd);
+	}
+	m->uart_fd = -1;
+	m->uart_lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(m->uart_lfd < 0){
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	unlink(path);
+	if(bind(m->uart_lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(m->uart_lfd, 1) < 0){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	return path;
+}
+
+static void
+onsignal(int sig)
+{
+	quit = 1;
+}
+
+static void
+ondump(int sig)
+{
+	dump = 1;
+}
+
+static void
+headless(Machine *m, unsigned long long cycles)
+{
+	unsigned long long insns;
+	uint64_t start, end, until, skip, s;
+	char buf[128];
+	struct timespec t0, t1, ts;
+	struct pollfd pfd;
+	double t;
+	int nap;
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+	signal(SIGUSR2, ondump);
+	fcntl(m->uart_fd, F_SETFL, fcntl(m->uart_fd, F_GETFL) | O_NONBLOCK);
+
+	start = m->cpu.cyc;
+	skip = m->idle_skip;
+	end = cycles < NEVER - start ? start + cycles : NEVER;
+	if(m->play && m->nplay > 0 && m->play[m->nplay - 1].kind == IN_END && m->play[m->nplay - 1].cyc < end)
+		end = m->play[m->nplay - 1].cyc;
+	insns = 0;
+	nap = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(m->cpu.cyc < end && !quit && !m->uart_eof){
+		until = m->cpu.cyc + FRAME < end ? m->cpu.cyc + FRAME : end;
+		if(m->play && play_next(m) < until)
+			until = play_next(m);
+		s = m->idle_skip;
+		insns += run(m, until);
+		if(m->play)
+			play_due(m);
+
+		/*
+		 * An open-ended run whose guest idled through the whole frame
+		 * is waiting for input: back off and sleep on the pty rather
+		 * than fast-forward through empty frames.
+		 */
+		if(end == NEVER && !m->play && (m->idle_skip - s) * 16 >= FRAME * 15){
+			nap = nap ? (nap < 16 ? nap * 2 : 16) : 1;
+			uart_poll(m, &pfd);
+			if(poll(&pfd, 1, nap) > 0 && !(pfd.revents & (POLLIN | POLLOUT))){
+				ts.tv_sec = 0;
+				ts.tv_nsec = nap * 1000000L;
+				nanosleep(&ts, NULL);
+			}
+		}else
+			nap = 0;
+
+		if(m->play)
+			uart_send(m);
+		else
+			uart_io(m);
+		if(dump && m->prof){
+			dump = 0;
+			prof_write(m);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if(m->prof)
+		prof_write(m);
+
+	cycles = m->cpu.cyc - start;
+	t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%llu cycles (%.1f%% idle), %llu instructions in %.3f s\n",
+		cycles, cycles ? 100.0 * (m->idle_skip - skip) / cycles : 0.0, insns, t);
+	if(t > 0 && insns > 0)
+		printf("%.3f MHz, %.0f instructions/s, %.2f ns/instruction\n",
+			cycles / t / 1e6, insns / t, t * 1e9 / insns);
+	if(m->play)
+		play_report(m);
+	if(m->rewind){
+		rewind_report(m->rewind, buf, sizeof(buf));
+		puts(buf);
+	}
+	if(m->jit){
+		jit_report(m->jit, buf, sizeof(buf));
+		puts(buf);
+	}
+}
+
+void
+audio_cb(void *userdata, uint8_t *stream, int len)
+{
+	Audio *a = userdata;
+	int16_t *out = (int16_t *)stream;
+	int head, tail, n, k;
+
+	n = len / 2;
+	head = SDL_AtomicGet(&a->head);
+	tail = SDL_AtomicGet(&a->tail);
+	k = (head - tail) & (AUDIO_SIZE - 1);
+	if(a->fill && k >= AUDIO_PREFILL)
+		a->fill = 0;
+	if(a->fill)
+		k = 0;
+	if(k > n)
+		k = n;
+	n -= k;
+	while(k > 0){
+		if(k < AUDIO_SIZE - tail){
+			memcpy(out, a->buf + tail, k * 2);
+			out += k;
+			tail += k;
+			k = 0;
+		}else{
+			memcpy(out, a->buf + tail, (AUDIO_SIZE - tail) * 2);
+			out += AUDIO_SIZE - tail;
+			k -= AUDIO_SIZE - tail;
+			tail = 0;
+		}
+	}
+	SDL_AtomicSet(&a->tail, tail);
+	if(out > (int16_t *)stream)
+		a->last = out[-1];
+
+	/* underrun: hold the last level and refill before resuming */
+	if(n > 0){
+		if(!a->fill)
+			SDL_AtomicAdd(&a->underruns, 1);
+		a->fill = 1;
+		while(n-- > 0)
+			*out++ = a->last;
+	}
+}
+
+/*
+ * Compose columns x0 to x1-1 of both 1-bpp planes into 4-colour pixels:
+ * plane 0 selects pal[1], plane 1 pal[2], both pal[3]. Planes are 40
+ * columns of 256 bytes, one byte per 8 pixels of a line, MSB leftmost.
+ * pixels points at the top left of column x0.
+ */
+static void
+draw(uint32_t *pixels, int pitch, const uint8_t *p0, const uint8_t *p1, const uint32_t pal[4], int x0, int x1)
+{
+	uint32_t *dst;
+	int x, y;
+#if defined(__AVX2__)
+	const __m256i bit = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	__m256i c0, c1, c2, c3, m0, m1, lo, hi;
+
+	c0 = _mm256_set1_epi32(pal[0]);
+	c1 = _mm256_set1_epi32(pal[1]);
+	c2 = _mm256_set1_epi32(pal[2]);
+	c3 = _mm256_set1_epi32(pal[3]);
+	for(y = 0; y < 240; y++){
+		dst = (uint32_t *)((uint8_t *)pixels + y * pitch);
+		for(x = x0; x < x1; x++, dst += 8){
+			m0 = _mm256_and_si256(_mm256_set1_epi32(p0[x << 8 | y]), bit);
+			m1 = _mm256_and_si256(_mm256_set1_epi32(p1[x << 8 | y]), bit);
+			m0 = _mm256_cmpeq_epi32(m0, bit);
+			m1 = _mm256_cmpeq_epi32(m1, bit);
+			lo = _mm256_blendv_epi8(c0, c1, m0);
+			hi = _mm256_blendv_epi8(c2, c3, m0);
+			_mm256_storeu_si256((__m256i *)dst, _mm256_blendv_epi8(lo, hi, m1));
+		}
+	}
+#elif defined(__SSE2__)
+	const __m128i bitl = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+	const __m128i bith = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+	__m128i c0, c1, c2, c3, a, b, m0, m1;
+
+#define MUX(m, t, f) _mm_or_si128(_mm_and_si128((m), (t)), _mm_andnot_si128((m), (f)))
+#define PIX(bit, d) \
+	m0 = _mm_cmpeq_epi32(_mm_and_si128(a, bit), bit); \
+	m1 = _mm_cmpeq_epi32(_mm_and_si128(b, bit), bit); \
+	_mm_storeu_si128((__m128i *)(d), MUX(m1, MUX(m0, c3, c2), MUX(m0, c1, c0)))
+
+	c0 = _mm_set1_epi32(pal[0]);
+	c1 = _mm_set1_epi32(pal[1]);
+	c2 = _mm_set1_epi32(pal[2]);
+	c3 = _mm_set1_epi32(pal[3]);
+	for(y = 0; y < 240; y++){
+		dst = (uint32_t *)((uint8_t *)pixels + y * pitch);
+		for(x = x0; x < x1; x++, dst += 8){
+			a = _mm_set1_epi32(p0[x << 8 | y]);
+			b = _mm_set1_epi32(p1[x << 8 | y]);
+			PIX(bitl, dst);
+			PIX(bith, dst + 4);
+		}
+	}
+#undef PIX
+#undef MUX
+#elif defined(__ARM_NEON)
+	static const uint32_t bits[8] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+	uint32x4_t bitl, bith, c0, c1, c2, c3, a, b, m0, m1;
+
+	bitl = vld1q_u32(bits);
+	bith = vld1q_u32(bits + 4);
+	c0 = vdupq_n_u32(pal[0]);
+	c1 = vdupq_n_u32(pal[1]);
+	c2 = vdupq_n_u32(pal[2]);
+	c3 = vdupq_n_u32(pal[3]);
+	for(y = 0; y < 240; y++){
+		dst = (uint32_t *)((uint8_t *)pixels + y * pitch);
+		for(x = x0; x < x1; x++, dst += 8){
+			a = vdupq_n_u32(p0[x << 8 | y]);
+			b = vdupq_n_u32(p1[x << 8 | y]);
+			m0 = vtstq_u32(a, bitl);
+			m1 = vtstq_u32(b, bitl);
+			vst1q_u32(dst, vbslq_u32(m1, vbslq_u32(m0, c3, c2), vbslq_u32(m0, c1, c0)));
+			m0 = vtstq_u32(a, bith);
+			m1 = vtstq_u32(b, bith);
+			vst1q_u32(dst + 4, vbslq_u32(m1, vbslq_u32(m0, c3, c2), vbslq_u32(m0, c1, c0)));
+		}
+	}
+#else
+	unsigned a, b;
+	int i;
+
+	for(y = 0; y < 240; y++){
+		dst = (uint32_t *)((uint8_t *)pixels + y * pitch);
+		for(x = x0; x < x1; x++){
+			a = p0[x << 8 | y];
+			b = p1[x << 8 | y] << 1;
+			for(i = 7; i >= 0; i--)
+				*dst++ = pal[(a >> i & 1) | (b >> i & 2)];
+		}
+	}
+#endif
+}
+
+/*
+ * Find the span of plane columns written since the last call. Each
+ * column sits in its own 256-byte stripe of RAM.
+ */
+static int
+vdirty(Machine *m, uint32_t base, int all, int *x0, int *x1)
+{
+	uint8_t *d0, *d1;
+	int x;
+
+	d0 = m->dirty + (base >> 8);
+	d1 = m->dirty + ((base + 0x4000) >> 8);
+	*x0 = 40;
+	*x1 = 0;
+	for(x = 0; x < 40; x++){
+		if(all || ((d0[x] | d1[x]) & DIRTY_VIDEO)){
+			if(x < *x0)
+				*x0 = x;
+			*x1 = x + 1;
+		}
+		d0[x] &= ~DIRTY_VIDEO;
+		d1[x] &= ~DIRTY_VIDEO;
+	}
+	return *x0 < *x1;
+}
+
+static void
+setup(Machine *m, uint8_t *rom, char *cffile, char *overlay)
+{
+	int i;
+
+	i8080_init(&m->cpu);
+	m->cpu.read_byte = read_byte;
+	m->cpu.write_byte = write_byte;
+	m->cpu.port_in = port_in;
+	m->cpu.port_out = port_out;
+	m->cpu.userdata = m;
+
+	for(i = 0; i < NEV; i++)
+		m->ev[i] = NEVER;
+	m->next = NEVER;
+	m->stop = 0;
+	m->frame = 0;
+	m->idle_pc = -1;
+	m->idle_skip = 0;
+	m->writes = 0;
+	m->cf_insns = 0;
+	m->rewind = NULL;
+	m->snap_base = 0;
+	schedule(m, EV_VINT, CPU_HZ / 60);
+
+	m->ram = malloc(SINK + 0x4000);
+	if(m->ram == NULL){
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	memset(m->dirty, 0xff, sizeof(m->dirty));
+	m->audio = NULL;
+	m->rom = rom;
+
+	m->ppi_a = 0xff;
+	m->ppi_b = 0xff;
+
+	m->kb_fifo.s = 2;
+	m->uart_fifo.s = 0;
+
+	m->js_buttons = 0;
+	m->js_state = 0;
+	m->uart_rxt = 0;
+	m->uart_cycles = baud < CPU_HZ * 10 ? CPU_HZ * 10 / baud : 1;	/* 8N1 */
+	m->uart_fd = -1;
+	m->uart_lfd = -1;
+	m->uart_eof = 0;
+	m->uart_in.head = m->uart_in.tail = 0;
+	m->uart_out.head = m->uart_out.tail = 0;
+	m->host_fd = -1;
+	m->ext_irq = 0;
+	m->prof = NULL;
+	m->trace = NULL;
+	m->rec = NULL;
+	m->play = NULL;
+	m->nplay = 0;
+	m->ahead = NULL;
+	m->speculative = 0;
+	m->lat = NULL;
+	m->prompt = NULL;
+	m->prompt_at = 0;
+
+	reset(m);
+
+	m->cf = cf_open(cffile, overlay);
+	if(m->cf == NULL){
+		perror(cffile);
+		exit(EXIT_FAILURE);
+	}
+	m->cf_size = cf_size(m->cf);
+
+	m->dc = NULL;
+	if(engine != ENGINE_PLAIN && (m->dc = dc_new(&m->cpu, m->map, rom, m->ram, m->dirty, DIRTY_CODE)) == NULL){
+		perror("dc_new()");
+		exit(EXIT_FAILURE);
+	}
+	/* without a JIT for this host, stay on the cache */
+	m->jit = NULL;
+	if(engine >= ENGINE_JIT && (m->jit = jit_new(&m->cpu, m->dc, m->map, rom, m->ram, engine == ENGINE_DIFF)) == NULL)
+		perror("jit_new()");
+	/* the JIT needs to see every write */
+	if(m->dc && m->jit == NULL)
+		dc_wmap(m->dc, m->wmap, &m->writes);
+}
+
+/*
+ * Many machines in one process, each with its own RAM, CF image or
+ * overlay and pty, sharing the ROM mapping and run one frame at a time
+ * by a pool of worker threads.
+ */
+typedef struct Instance Instance;
+struct Instance{
+	Machine m;
+	int id;
+	uint64_t start;
+	uint64_t end;
+	uint64_t skip;
+	unsigned long long insns;
+	uint64_t ns;	/* time spent running it */
+	int nap;
+	char *save;
+	SDL_atomic_t dump;	/* write the profile before the next slice */
+};
+
+static volatile sig_atomic_t report;
+
+static void
+onreport(int sig)
+{
+	report = 1;
+}
+
+static uint64_t
+slice(void *task, int w)
+{
+	Instance *in;
+	Machine *m;
+	uint64_t t0, t1, until, s;
+
+	in = task;
+	m = &in->m;
+	if(quit || m->cpu.cyc >= in->end)
+		return 0;
+	if(m->prof && SDL_AtomicGet(&in->dump)){
+		SDL_AtomicSet(&in->dump, 0);
+		prof_write(m);
+	}
+	uart_io(m);
+	until = m->cpu.cyc + FRAME < in->end ? m->cpu.cyc + FRAME : in->end;
+	s = m->idle_skip;
+	t0 = pool_now();
+	in->insns += run(m, until);
+	t1 = pool_now();
+	in->ns += t1 - t0;
+
+	/* waiting for input, as in headless() */
+	if(in->end == NEVER && (m->idle_skip - s) * 16 >= FRAME * 15){
+		in->nap = in->nap ? (in->nap < 16 ? in->nap * 2 : 16) : 1;
+		return t1 + in->nap * 1000000ULL;
+	}
+	in->nap = 0;
+	return 1;
+}
+
+static void
+fleet_report(Instance *in, int n, int workers, Pool *pool, double t)
+{
+	unsigned long long cycles, insns, tc, ti;
+	int i;
+
+	tc = ti = 0;
+	for(i = 0; i < n; i++){
+		cycles = in[i].m.cpu.cyc - in[i].start;
+		insns = in[i].insns;
+		printf("%d: %llu cycles (%.1f%% idle), %llu instructions, %.3f s running, %.3f MHz\n",
+			in[i].id, cycles, cycles ? 100.0 * (in[i].m.idle_skip - in[i].skip) / cycles : 0.0,
+			insns, in[i].ns / 1e9, in[i].ns ? cycles * 1e3 / in[i].ns : 0.0);
+		tc += cycles;
+		ti += insns;
+	}
+	printf("%d machines on %d workers, %llu steals: %llu cycles, %llu instructions in %.3f s\n",
+		n, workers, (unsigned long long)pool_steals(pool), tc, ti, t);
+	if(t > 0)
+		printf("%.3f MHz, %.0f instructions/s aggregate\n", tc / t / 1e6, ti / t);
+	fflush(stdout);
+}
+
+/* fmt with its %d, if any, replaced by i */
+static char *
+instpath(char *fmt, int i)
+{
+	char *p, *s;
+	size_t len;
+
+	if(fmt == NULL)
+		return NULL;
+	p = strstr(fmt, "%d");
+	len = strlen(fmt) + 16;
+	s = malloc(len);
+	if(s == NULL){
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	if(p)
+		snprintf(s, len, "%.*s%d%s", (int)(p - fmt), fmt, i, p + 2);
+	else
+		snprintf(s, len, "%s", fmt);
+	return s;
+}
+
+static void
+fleet(uint8_t *rom, char **files, int nfiles, int n, int workers, char *overlay, char *load, char *save, unsigned long long cycles)
+{
+	Instance *in;
+	Machine *m;
+	Pool *pool;
+	void **tasks;
+	struct timespec t0, t1;
+	char *ovl, *path;
+	int i;
+
+	if(n < nfiles)
+		n = nfiles;
+	if(workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers > n)
+		workers = n;
+	if(n > nfiles && (overlay == NULL || strstr(overlay, "%d") == NULL)){
+		fprintf(stderr, "machines sharing a CF image need -o with %%d in the overlay name\n");
+		exit(EXIT_FAILURE);
+	}
+	if(n > 1 && uartsock && strstr(uartsock, "%d") == NULL){
+		fprintf(stderr, "several machines need -U with %%d in the socket name\n");
+		exit(EXIT_FAILURE);
+	}
+	in = calloc(n, sizeof(Instance));
+	tasks = calloc(n, sizeof(void *));
+	if(in == NULL || tasks == NULL){
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < n; i++){
+		m = &in[i].m;
+		ovl = instpath(overlay, i);
+		setup(m, rom, files[i % nfiles], ovl);
+		free(ovl);
+		if(profpath)
+			prof_start(m, instpath(profpath, i));
+		if(tracepath){
+			path = instpath(tracepath, i);
+			trace_start(m, path);
+			free(path);
+		}
+		path = instpath(uartsock, i);
+		printf("%d: %s\n", i, uart_open(m, path));
+		free(path);
+		m->sng = SNG_new(CPU_HZ, 44100);
+		if(m->sng == NULL){
+			perror("SNG_new()");
+			exit(EXIT_FAILURE);
+		}
+		if(load && snap_load(m, load) < 0){
+			perror(load);
+			exit(EXIT_FAILURE);
+		}
+		in[i].id = i;
+		in[i].save = n > 1 && save && strstr(save, "%d") == NULL ? NULL : instpath(save, i);
+		in[i].start = m->cpu.cyc;
+		in[i].skip = m->idle_skip;
+		in[i].end = cycles < NEVER - in[i].start ? in[i].start + cycles : NEVER;
+		tasks[i] = &in[i];
+	}
+	if(save && in[0].save == NULL)
+		fprintf(stderr, "%s: no %%d, snapshots not saved\n", save);
+	fflush(stdout);
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+	signal(SIGUSR1, onreport);
+	signal(SIGUSR2, ondump);
+	pool = pool_new(workers, n, tasks);
+	if(pool == NULL){
+		perror("pool_new()");
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(pool_start(pool, slice) < 0){
+		perror("pool_start()");
+		exit(EXIT_FAILURE);
+	}
+	while(pool_wait(pool, 100) > 0){
+		if(report){
+			report = 0;
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			fleet_report(in, n, workers, pool, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+		}
+		if(dump){
+			/* each by its worker, between slices */
+			dump = 0;
+			for(i = 0; i < n; i++)
+				SDL_AtomicSet(&in[i].dump, 1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fleet_report(in, n, workers, pool, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	pool_free(pool);
+
+	for(i = 0; i < n; i++){
+		m = &in[i].m;
+		if(in[i].save && snap_save(m, in[i].save, 0) < 0)
+			perror(in[i].save);
+		free(in[i].save);
+		SNG_delete(m->sng);
+		cf_close(m->cf);
+		close(m->uart_fd);
+		close(m->uart_lfd);
+		if(m->prof){
+			prof_write(m);
+			prof_free(m->prof);
+			free(m->prof_path);
+		}
+		if(m->trace)
+			trace_stop(m);
+		if(m->jit)
+			jit_free(m->jit);
+		if(m->dc)
+			dc_free(m->dc);
+		free(m->ram);
+	}
+	free(tasks);
+	free(in);
+}
+
+/*
+ * Fork server: boot once, up to the prompt or for the given cycles,
+ * then fork a child per connection on a unix socket. The child talks
+ * to the connection through the UART, starting from the prompt, and
+ * has RAM and CF writes of its own through copy-on-write.
+ */
+static void
+serve(Machine *m, char *path, char *prompt, unsigned long long cycles)
+{
+	struct sockaddr_un sa;
+	struct sigaction act;
+	uint64_t end;
+	int lfd, cfd, ret;
+	pid_t pid;
+
+	m->uart_fd = open("/dev/null", O_RDWR);
+	m->prompt = prompt;
+	/* no SA_RESTART: a signal has to get accept() out with EINTR */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = onsignal;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	end = cycles < NEVER - m->cpu.cyc ? m->cpu.cyc + cycles : NEVER;
+	if(prompt == NULL && end == NEVER)
+		end = m->cpu.cyc;
+	while(!quit && m->cpu.cyc < end && !(prompt && prompt[m->prompt_at] == '\0'))
+		run(m, m->cpu.cyc + FRAME < end ? m->cpu.cyc + FRAME : end);
+	if(prompt && prompt[m->prompt_at] == '\0')
+		printf("prompt after %llu cycles\n", (unsigned long long)m->cpu.cyc);
+	else if(prompt){
+		fprintf(stderr, "no prompt after %llu cycles\n", (unsigned long long)m->cpu.cyc);
+		exit(EXIT_FAILURE);
+	}
+	close(m->uart_fd);
+	m->uart_out.tail = m->uart_out.head;
+	m->prompt = NULL;
+	if(cf_fork(m->cf) < 0){
+		perror("cf_fork()");
+		exit(EXIT_FAILURE);
+	}
+	resync(m);	/* a sector being transferred now lives in the private mapping */
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(lfd < 0){
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	unlink(path);
+	if(bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(lfd, 64) < 0){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	printf("serving on %s\n", path);
+	fflush(stdout);
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	while(!quit){
+		cfd = accept(lfd, NULL, NULL);
+		if(cfd < 0){
+			if(errno == EINTR)
+				continue;
+			perror("accept()");
+			break;
+		}
+		pid = fork();
+		if(pid < 0)
+			perror("fork()");
+		if(pid != 0){
+			close(cfd);
+			continue;
+		}
+
+		close(lfd);
+		signal(SIGCHLD, SIG_DFL);
+		m->uart_fd = cfd;
+		if(prompt){
+			ret = write(cfd, prompt, strlen(prompt));
+			(void)ret;
+		}
+		headless(m, ~0ULL);
+		cf_close(m->cf);
+		_exit(0);
+	}
+	close(lfd);
+	unlink(path);
+}
+
+static void
+usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-e engine] [-H hostdir] [-b baud] [-U socket] [-P profile] [-T trace] [-I inputs | -Y inputs] [-A frames] [-L] [-n] [-c cycles | -f frames] [-o overlay] [-l snapfile] [-s snapfile [-i]] [-r megabytes] romfile cffile\n", name);
+	fprintf(stderr, "       %s -F socket [-p prompt] [-c cycles | -f frames] [-o overlay] [-l snapfile] romfile cffile\n", name);
+	fprintf(stderr, "       %s [-N machines] [-j workers] [-b baud] [-U socket] [-P profile] [-T trace] [-c cycles | -f frames] [-o overlay] [-l snapfile] [-s snapfile] romfile cffile...\n", name);
+	fprintf(stderr, "       %s -o overlay -C | -D cffile\n", name);
+	fprintf(stderr, "       %s -z cfzfile cffile\n", name);
+	exit(EXIT_FAILURE);
+}
+
+enum{
+	FDS_PTY,
+	FDS_TIMER,
+	NFDS
+};
+
+/* queue a command for the machine, waiting in the unlikely case the ring is full */
+static void
+command(Screen *s, int op, int val, uint64_t t)
+{
+	Cmd *c;
+	unsigned head;
+
+	head = SDL_AtomicGet(&s->head);
+	while(head - SDL_AtomicGet(&s->tail) == CMD_SIZE)
+		SDL_Delay(1);
+	c = &s->cmd[head % CMD_SIZE];
+	c->op = op;
+	c->val = val;
+	c->t = t;
+	SDL_AtomicSet(&s->head, head + 1);
+}
+
+/* carry out the commands queued since the last frame; 1 to quit */
+static int
+commands(Screen *s, int *rewinding)
+{
+	Machine *m;
+	Cmd *c;
+	unsigned head, tail;
+	int done;
+
+	m = s->m;
+	done = 0;
+	head = SDL_AtomicGet(&s->head);
+	for(tail = SDL_AtomicGet(&s->tail); tail != head; tail++){
+		c = &s->cmd[tail % CMD_SIZE];
+		switch(c->op){
+		case CMD_KEY:
+			kbd_push(m, c->val);
+			if(m->lat && c->t)
+				lat_key(m, c->val, c->t);
+			break;
+		case CMD_JS:
+			m->js_buttons = c->val;
+			break;
+		case CMD_REWIND:
+			*rewinding = m->rewind && c->val;
+			break;
+		case CMD_RESET:
+			if(m->rec)
+				rec_put(m, IN_RESET, 0);
+			reset(m);
+			break;
+		case CMD_SAVE:
+			if(snap_save(m, s->save, s->incremental) < 0)
+				SDL_Log("%s: %s", s->save, strerror(errno));
+			break;
+		case CMD_QUIT:
+			done = 1;
+			break;
+		}
+	}
+	SDL_AtomicSet(&s->tail, tail);
+	return done;
+}
+
+/*
+ * Bring the back buffer up to date with the planes and make it the
+ * latest frame, if anything changed. A buffer is drawn one frame in
+ * three, so each keeps the columns changed since it last was.
+ */
+static void
+publish(Screen *s, int all)
+{
+	Machine *m;
+	Frame *f;
+	SDL_Event ev;
+	uint64_t cols;
+	uint32_t base;
+	int i, x0, x1, prev;
+
+	m = s->m;
+	base = (m->ppi_c & VA15) ? 0x19810 : 0x11810;
+	if(m->lat && m->lat->state == 3){
+		s->key.read = 1;
+		s->key.code = m->lat->code;
+		s->key.t0 = m->lat->t0;
+		s->key.t1 = m->lat->t1;
+		m->lat->state = 0;
+	}
+	if(!vdirty(m, base, all || base != s->shown, &x0, &x1))
+		return;
+	s->shown = base;
+	cols = ((1ULL << (x1 - x0)) - 1) << x0;
+	for(i = 0; i < 3; i++)
+		s->cols[i] |= cols;
+
+	f = &s->frame[s->back];
+	cols = s->cols[s->back];
+	for(x0 = 0; x0 < 40; x0 = x1){
+		while(x0 < 40 && !(cols >> x0 & 1))
+			x0++;
+		for(x1 = x0; x1 < 40 && (cols >> x1 & 1); x1++)
+			;
+		if(x0 < x1)
+			draw(f->px + x0 * 8, 320 * sizeof(uint32_t), m->ram + base, m->ram + base + 0x4000, s->pal, x0, x1);
+	}
+	s->cols[s->back] = 0;
+	f->key = s->key;
+	s->key.read = 0;
+
+	prev = SDL_AtomicSet(&s->latest, s->back | FRESH);
+	s->back = prev & 3;
+	if(prev & FRESH){
+		/* skipped: its key shows in the next one; an event is still pending */
+		if(s->frame[s->back].key.read)
+			s->key = s->frame[s->back].key;
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.type = s->event;
+	SDL_PushEvent(&ev);
+}
+
+/* the machine's thread: a frame per tick of a 60 Hz timer */
+static void *
+emulate(void *arg)
+{
+	Screen *s;
+	Machine *m;
+	struct pollfd fds[NFDS];
+	struct itimerspec it;
+	uint64_t val, sync;
+	int ret, rewinding, redraw;
+
+	s = arg;
+	m = s->m;
+	fds[FDS_TIMER].fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	fds[FDS_TIMER].events = POLLIN;
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_nsec = 16666666;
+	it.it_value.tv_sec = 0;
+	it.it_value.tv_nsec = 16666666;
+	timerfd_settime(fds[FDS_TIMER].fd, 0, &it, NULL);
+	sync = m->cpu.cyc * 60 / CPU_HZ;
+	rewinding = 0;
+	redraw = 1;
+
+	for(;;){
+		uart_poll(m, &fds[FDS_PTY]);
+		ret = poll(fds, NFDS, -1);
+		if(ret < 0 && errno != EINTR){
+			perror("poll()");
+			exit(EXIT_FAILURE);
+		}
+
+		if(fds[FDS_PTY].revents & (POLLERR | POLLHUP)){
+			uart_hangup(m);
+			if(m->uart_lfd < 0){
+				puts(uart_open(m, NULL));
+				fflush(stdout);
+			}
+		}else if(fds[FDS_PTY].revents & (POLLIN | POLLOUT))
+			uart_io(m);
+
+		if(!(fds[FDS_TIMER].revents & POLLIN))
+			continue;
+		ret = read(fds[FDS_TIMER].fd, &val, sizeof(val));
+		sync += val;
+		if(rewinding){
+			rewind_step(m);
+			sync = m->cpu.cyc * 60 / CPU_HZ;
+			redraw = 1;
+		}else{
+			run(m, sync * CPU_HZ / 60);
+			psg_sync(m);
+		}
+		if(dump && m->prof){
+			dump = 0;
+			prof_write(m);
+		}
+
+		ret = commands(s, &rewinding);
+		if(m->rec && m->js_buttons != m->rec_js){
+			m->rec_js = m->js_buttons;
+			rec_put(m, IN_JS, m->js_buttons);
+		}
+		if(ret)
+			break;
+
+		if(m->ahead && !rewinding)
+			ahead_go(m, sync + m->ahead->frames);
+		publish(s, redraw);
+		if(m->speculative)
+			ahead_back(m);
+		redraw = 0;
+	}
+	close(fds[FDS_TIMER].fd);
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	Machine	machine;
+	Machine *m;
+	Screen *scr;
+	int romfd, ret, buttonid, opt, nosdl, front;
+	unsigned long long cycles;
+	char *overlay, *packed, *load, *save, *sock, *prompt;
+	int cmd, incremental, ninst, workers;
+	uint8_t *rom;
+	uint16_t jsbuttons;
+	long rewindmb;
+	char report[128];
+	SDL_Window *window;
+	SDL_Renderer *renderer;
+	SDL_RendererInfo info;
+	Uint32 format, pal[4];
+	SDL_PixelFormat *pixelformat;
+	SDL_Texture *texture;
+	SDL_Event event;
+	SDL_MessageBoxData messageboxdata;
+	SDL_MessageBoxButtonData buttons[4];
+	SDL_AudioSpec want = {0}, have;
+	SDL_AudioDeviceID audiodev;
+	SDL_Joystick *js;
+	SDL_JoystickGUID guid;
+
+	nosdl = 0;
+	cycles = ~0ULL;
+	overlay = NULL;
+	packed = NULL;
+	load = NULL;
+	save = NULL;
+	incremental = 0;
+	rewindmb = -1;
+	ninst = 1;
+	workers = 0;
+	sock = NULL;
+	prompt = NULL;
+	cmd = 0;
+	while((opt = getopt(argc, argv, "nc:f:o:CDz:l:s:ir:N:j:F:p:e:H:b:U:P:T:I:Y:A:L")) != -1){
+		switch(opt){
+		case 'n':
+			nosdl = 1;
+			break;
+		case 'c':
+			cycles = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			cycles = strtoull(optarg, NULL, 0) * FRAME;
+			break;
+		case 'o':
+			overlay = optarg;
+			break;
+		case 'C':
+		case 'D':
+			cmd = opt;
+			break;
+		case 'z':
+			packed = optarg;
+			break;
+		case 'l':
+			load = optarg;
+			break;
+		case 's':
+			save = optarg;
+			break;
+		case 'i':
+			incremental = 1;
+			break;
+		case 'r':
+			rewindmb = strtol(optarg, NULL, 0);
+			break;
+		case 'N':
+			ninst = strtol(optarg, NULL, 0);
+			break;
+		case 'j':
+			workers = strtol(optarg, NULL, 0);
+			break;
+		case 'F':
+			sock = optarg;
+			break;
+		case 'H':
+			hostdir = open(optarg, O_RDONLY | O_DIRECTORY);
+			if(hostdir < 0){
+				perror(optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			prompt = optarg;
+			break;
+		case 'b':
+			baud = strtol(optarg, NULL, 0);
+			if(baud <= 0)
+				usage(argv[0]);
+			break;
+		case 'U':
+			uartsock = optarg;
+			break;
+		case 'P':
+			profpath = optarg;
+			break;
+		case 'T':
+			tracepath = optarg;
+			break;
+		case 'I':
+			recpath = optarg;
+			break;
+		case 'Y':
+			playpath = optarg;
+			break;
+		case 'A':
+			aheadframes = strtol(optarg, NULL, 0);
+			if(aheadframes < 0 || aheadframes > AHEAD_MAX)
+				usage(argv[0]);
+			break;
+		case 'L':
+			latency = 1;
+			break;
+		case 'e':
+			if(strcmp(optarg, "plain") == 0)
+				engine = ENGINE_PLAIN;
+			else if(strcmp(optarg, "cache") == 0)
+				engine = ENGINE_CACHE;
+			else if(strcmp(optarg, "jit") == 0)
+				engine = ENGINE_JIT;
+			else if(strcmp(optarg, "diff") == 0)
+				engine = ENGINE_DIFF;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(sock && uartsock){
+		fprintf(stderr, "-F serves on its own socket, not -U\n");
+		exit(EXIT_FAILURE);
+	}
+	if(sock && profpath){
+		fprintf(stderr, "-P cannot profile the children of -F\n");
+		exit(EXIT_FAILURE);
+	}
+	if(sock || playpath)
+		nosdl = 1;
+	if(recpath)
+		rewindmb = 0;	/* going back would leave inputs out of order */
+	if(packed){
+		if(argc - optind != 1)
+			usage(argv[0]);
+		if(cf_compress(argv[optind], packed) < 0){
+			perror(packed);
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
+	if(cmd){
+		if(overlay == NULL || argc - optind != 1)
+			usage(argv[0]);
+		m = &machine;
+		m->cf = cf_open(argv[optind], overlay);
+		if(m->cf == NULL){
+			perror(argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+		if(cmd == 'C'){
+			ret = cf_commit(m->cf);
+			if(ret >= 0)
+				printf("%d sectors committed\n", ret);
+		}else
+			ret = cf_discard(m->cf);
+		if(ret < 0){
+			perror(overlay);
+			exit(EXIT_FAILURE);
+		}
+		cf_close(m->cf);
+		return 0;
+	}
+	if(argc - optind < 2)
+		usage(argv[0]);
+	argv += optind;
+
+	romfd = open(argv[0], O_RDONLY);
+	if(romfd < 0){
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	rom = mmap(NULL, 16 * 1024, PROT_READ, MAP_PRIVATE, romfd, 0);
+	if(rom == MAP_FAILED){
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
+	bus_init();
+	if(hostdir >= 0)
+		attach(&host_dev);
+
+	if(ninst > 1 || argc - optind > 2 || workers > 0){
+		fleet(rom, argv + 1, argc - optind - 1, ninst, workers, overlay, load, save, cycles);
+		return 0;
+	}
+
+	m = &machine;
+	setup(m, rom, argv[1], overlay);
+	if(profpath)
+		prof_start(m, profpath);
+	if(tracepath && sock == NULL)
+		trace_start(m, tracepath);
+
+	puts(uart_open(m, uartsock));
+	fflush(stdout);
+
+	if(nosdl){
+		m->sng = SNG_new(CPU_HZ, 44100);
+		if(m->sng == NULL){
+			perror("SNG_new()");
+			exit(EXIT_FAILURE);
+		}
+		if(load && snap_load(m, load) < 0){
+			perror(load);
+			exit(EXIT_FAILURE);
+		}
+		if(sock){
+			serve(m, sock, prompt, cycles);
+			SNG_delete(m->sng);
+			cf_close(m->cf);
+			return 0;
+		}
+		m->snap_base = load && save && strcmp(load, save) == 0;
+		if(rewindmb > 0 && (m->rewind = rewind_new(m, (size_t)rewindmb << 20)) == NULL){
+			perror("rewind_new()");
+			exit(EXIT_FAILURE);
+		}
+		if(playpath)
+			play_open(m, playpath);
+		else if(recpath)
+			rec_open(m, recpath);
+		headless(m, cycles);
+		if(m->rec)
+			rec_close(m);
+		if(m->trace)
+			trace_stop(m);
+		if(save && snap_save(m, save, incremental) < 0){
+			perror(save);
+			exit(EXIT_FAILURE);
+		}
+		SNG_delete(m->sng);
+		cf_close(m->cf);
+		return 0;
+	}
+
+	if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK) != 0){
+		SDL_Log("SDL_Init(): %s", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	window = SDL_CreateWindow("pac80emu", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, 0);
+	if(window == NULL){
+		SDL_Log("SDL_CreateWindow(): %s", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	if(renderer == NULL){
+		SDL_Log("SDL_CreateRenderer(): %s", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	SDL_RenderSetLogicalSize(renderer, 320, 240);
+	SDL_RenderSetIntegerScale(renderer, SDL_TRUE);
+	SDL_GetRendererInfo(renderer, &info);
+	format = info.texture_formats[0];
+	pixelformat = SDL_AllocFormat(format);
+	pal[0] = SDL_MapRGB(pixelformat, 0, 0, 0);
+	pal[1] = SDL_MapRGB(pixelformat, 42, 84, 126);
+	pal[2] = SDL_MapRGB(pixelformat, 210, 168, 126);
+	pal[3] = SDL_MapRGB(pixelformat, 252, 252, 252);
+	SDL_FreeFormat(pixelformat);
+	texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, 320, 240);
+	if(texture == NULL){
+		SDL_Log("SDL_CreateTexture(): %s", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_NONE);
+
+	m->audio = calloc(1, sizeof(Audio));
+	if(m->audio == NULL){
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	want.freq = 44100;
+	want.format = AUDIO_S16SYS;
+	want.channels = 1;
+	want.samples = 128;
+	want.callback = audio_cb;
+	want.userdata = m->audio;	/* m->audio is NULL while running ahead */
+	audiodev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+	if(audiodev == 0){
+		SDL_Log("SDL_OpenAudioDevice(): %s", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	m->sng = SNG_new(CPU_HZ, have.freq);
+	if(m->sng == NULL){
+		perror("SNG_new()");
+		exit(EXIT_FAILURE);
+	}
+	SNG_set_quality(m->sng, 0);
+	if(load && snap_load(m, load) < 0){
+		perror(load);
+		exit(EXIT_FAILURE);
+	}
+	m->snap_base = load && save && strcmp(load, save) == 0;
+	if(rewindmb < 0)
+		rewindmb = 32;
+	if(rewindmb > 0 && (m->rewind = rewind_new(m, (size_t)rewindmb << 20)) == NULL){
+		perror("rewind_new()");
+		exit(EXIT_FAILURE);
+	}
+	if(recpath)
+		rec_open(m, recpath);
+	if(aheadframes > 0 && (m->ahead = ahead_new(m, aheadframes)) == NULL){
+		perror("ahead_new()");
+		exit(EXIT_FAILURE);
+	}
+	if(latency && (m->lat = calloc(1, sizeof(Latency))) == NULL){
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	m->audio->rate = ((uint64_t)CPU_HZ << 16) / have.freq;
+	m->audio->pos = (uint64_t)m->cpu.cyc << 16;
+	m->audio->fill = 1;
+	SDL_PauseAudioDevice(audiodev, 0);
+
+	scr = calloc(1, sizeof(Screen));
+	if(scr == NULL){
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	scr->m = m;
+	scr->back = 0;
+	SDL_AtomicSet(&scr->latest, 1);
+	front = 2;
+	memcpy(scr->pal, pal, sizeof(pal));
+	scr->event = SDL_RegisterEvents(1);
+	scr->save = save;
+	scr->incremental = incremental;
+	js = NULL;
+	jsbuttons = 0;
+	signal(SIGUSR2, ondump);
+	ret = pthread_create(&scr->thread, NULL, emulate, scr);
+	if(ret != 0){
+		SDL_Log("pthread_create(): %s", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	while(SDL_WaitEvent(&event)){
+		if(event.type == scr->event){
+			if(!(SDL_AtomicGet(&scr->latest) & FRESH))
+				continue;
+			front = SDL_AtomicSet(&scr->latest, front) & 3;
+			SDL_UpdateTexture(texture, NULL, scr->frame[front].px, 320 * sizeof(uint32_t));
+			SDL_RenderCopy(renderer, texture, NULL, NULL);
+			SDL_RenderPresent(renderer);
+			if(scr->frame[front].key.read)
+				lat_shown(m->lat, &scr->frame[front].key);
+		}else if((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && m->rewind &&
+		   event.key.keysym.scancode == SDL_SCANCODE_BACKSPACE && (event.key.keysym.mod & KMOD_ALT)){
+			command(scr, CMD_REWIND, event.type == SDL_KEYDOWN, 0);
+		}else if(event.type == SDL_KEYDOWN){
+			command(scr, CMD_KEY, xlat[event.key.keysym.scancode], m->lat && !event.key.repeat ?
+				pool_now() - (SDL_GetTicks() - event.key.timestamp) * 1000000ULL : 0);
+		}else if(event.type == SDL_KEYUP){
+			command(scr, CMD_KEY, xlat[event.key.keysym.scancode] | 0x80, 0);
+		}else if(event.type == SDL_JOYBUTTONDOWN){
+			if(event.jbutton.button < sizeof(js_map) / sizeof(js_map[0]))
+				command(scr, CMD_JS, jsbuttons |= js_map[event.jbutton.button], 0);
+		}else if(event.type == SDL_JOYBUTTONUP){
+			if(event.jbutton.button < sizeof(js_map) / sizeof(js_map[0]))
+				command(scr, CMD_JS, jsbuttons &= ~js_map[event.jbutton.button], 0);
+		}else if(event.type == SDL_JOYHATMOTION){
+			jsbuttons &= ~(BUTTON_U | BUTTON_D | BUTTON_L | BUTTON_R);
+			if(event.jhat.value & SDL_HAT_UP)
+				 jsbuttons |= BUTTON_U;
+			if(event.jhat.value & SDL_HAT_DOWN)
+				 jsbuttons |= BUTTON_D;
+			if(event.jhat.value & SDL_HAT_LEFT)
+				 jsbuttons |= BUTTON_L;
+			if(event.jhat.value & SDL_HAT_RIGHT)
+				 jsbuttons |= BUTTON_R;
+			command(scr, CMD_JS, jsbuttons, 0);
+		}else if(event.type == SDL_JOYDEVICEADDED && js == NULL){
+			guid = SDL_JoystickGetDeviceGUID(event.jdevice.which);
+			if(memcmp(js_guid, &guid, sizeof(js_guid)) == 0){
+				js = SDL_JoystickOpen(event.jdevice.which);
+				if(js == NULL)
+					SDL_Log("SDL_JoystickOpen(): %s", SDL_GetError());
+			}
+		}else if(event.type == SDL_JOYDEVICEREMOVED && js != NULL){
+			SDL_JoystickClose(js);
+			js = NULL;
+		}else if(event.type == SDL_WINDOWEVENT){
+			SDL_RenderCopy(renderer, texture, NULL, NULL);
+			SDL_RenderPresent(renderer);
+		}else if(event.type == SDL_QUIT){
+			messageboxdata.flags = 0;
+			messageboxdata.window = NULL;
+			messageboxdata.title = "Dialog";
+			messageboxdata.message = "Leave?";
+			messageboxdata.numbuttons = save ? 4 : 3;
+			buttons[0].flags = SDL_MESSAGEBOX_BUTTON_RETURNKEY_DEFAULT;
+			buttons[0].buttonid = 0;
+			buttons[0].text = "Quit";
+			buttons[1].flags = 0;
+			buttons[1].buttonid = 1;
+			buttons[1].text = "Reset";
+			buttons[2].flags = SDL_MESSAGEBOX_BUTTON_ESCAPEKEY_DEFAULT;
+			buttons[2].buttonid = 2;
+			buttons[2].text = "Cancel";
+			buttons[3].flags = 0;
+			buttons[3].buttonid = 3;
+			buttons[3].text = "Save";
+			messageboxdata.buttons = buttons;
+			messageboxdata.colorScheme = NULL;
+			ret = SDL_ShowMessageBox(&messageboxdata, &buttonid);
+			if(ret != 0 || buttonid == 0)
+				break;
+			else if(buttonid == 1)
+				command(scr, CMD_RESET, 0, 0);
+			else if(buttonid == 3)
+				command(scr, CMD_SAVE, 0, 0);
+		}
+	}
+	command(scr, CMD_QUIT, 0, 0);
+	pthread_join(scr->thread, NULL);
+	free(scr);
+	if(save && snap_save(m, save, incremental) < 0)
+		SDL_Log("%s: %s", save, strerror(errno));
+	if(m->prof)
+		prof_write(m);
+	if(m->trace)
+		trace_stop(m);
+	if(m->rec)
+		rec_close(m);
+	if(m->rewind){
+		rewind_report(m->rewind, report, sizeof(report));
+		SDL_Log("%s", report);
+	}
+	if(m->ahead){
+		ahead_report(m->ahead, report, sizeof(report));
+		SDL_Log("%s", report);
+		free(m->ahead);
+	}
+	if(m->lat){
+		lat_report(m->lat, report, sizeof(report));
+		SDL_Log("%s", report);
+		free(m->lat);
 	}
 	if(js)
 		SDL_JoystickClose(js);
 	SDL_CloseAudioDevice(audiodev);
+	if(m->audio->overruns || SDL_AtomicGet(&m->audio->underruns))
+		SDL_Log("audio: %lu overruns, %d underruns", m->audio->overruns, SDL_AtomicGet(&m->audio->underruns));
 	SNG_delete(m->sng);
+	free(m->audio);
+	cf_close(m->cf);
 	SDL_DestroyTexture(texture);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
@@ -0,0 +1,268 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pool.h"
+
+/*
+ * Every worker owns a deque of runnable tasks. It takes slices from the
+ * head of its own and puts tasks back at the tail, so its tasks share
+ * it round robin; a worker whose deque is empty steals from the tail
+ * of the others'. Each deque is big enough for every task.
+ */
+typedef struct Task Task;
+struct Task{
+	void *arg;
+	uint64_t due;
+};
+
+typedef struct Deque Deque;
+struct Deque{
+	pthread_mutex_t lock;
+	Task *t;
+	unsigned head;
+	unsigned tail;
+};
+
+typedef struct Worker Worker;
+struct Worker{
+	Pool *p;
+	int id;
+	pthread_t thread;
+};
+
+struct Pool{
+	int nworkers;
+	int ntasks;
+	unsigned mask;
+	Deque *q;
+	Worker *w;
+	Slice fn;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int left;
+	uint64_t steals;
+};
+
+uint64_t
+pool_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+nap(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	nanosleep(&ts, NULL);
+}
+
+static void
+put(Pool *p, int w, Task t)
+{
+	Deque *q;
+
+	q = &p->q[w];
+	pthread_mutex_lock(&q->lock);
+	q->t[q->tail++ & p->mask] = t;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static int
+take(Pool *p, int w, Task *t)
+{
+	Deque *q;
+	int i, ok;
+
+	q = &p->q[w];
+	pthread_mutex_lock(&q->lock);
+	ok = q->head != q->tail;
+	if(ok)
+		*t = q->t[q->head++ & p->mask];
+	pthread_mutex_unlock(&q->lock);
+	if(ok)
+		return 1;
+	for(i = 1; i < p->nworkers; i++){
+		q = &p->q[(w + i) % p->nworkers];
+		pthread_mutex_lock(&q->lock);
+		ok = q->head != q->tail;
+		if(ok)
+			*t = q->t[--q->tail & p->mask];
+		pthread_mutex_unlock(&q->lock);
+		if(ok){
+			pthread_mutex_lock(&p->lock);
+			p->steals++;
+			pthread_mutex_unlock(&p->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *
+worker(void *arg)
+{
+	Worker *self;
+	Pool *p;
+	Task t;
+	uint64_t now, due;
+	int left, waited;
+
+	self = arg;
+	p = self->p;
+	waited = 0;
+	for(;;){
+		pthread_mutex_lock(&p->lock);
+		left = p->left;
+		pthread_mutex_unlock(&p->lock);
+		if(left == 0)
+			break;
+		if(!take(p, self->id, &t)){
+			nap(200000);	/* the rest are running elsewhere */
+			continue;
+		}
+		now = pool_now();
+		if(t.due > now){
+			put(p, self->id, t);
+			if(++waited > p->ntasks){
+				nap(t.due - now < 1000000 ? t.due - now : 1000000);
+				waited = 0;
+			}
+			continue;
+		}
+		waited = 0;
+		due = p->fn(t.arg, self->id);
+		if(due == 0){
+			pthread_mutex_lock(&p->lock);
+			if(--p->left == 0)
+				pthread_cond_broadcast(&p->done);
+			pthread_mutex_unlock(&p->lock);
+		}else{
+			t.due = due;
+			put(p, self->id, t);
+		}
+	}
+	return NULL;
+}
+
+Pool *
+pool_new(int nworkers, int ntasks, void **tasks)
+{
+	Pool *p;
+	Task t;
+	int i;
+
+	p = calloc(1, sizeof(Pool));
+	if(p == NULL)
+		return NULL;
+	p->nworkers = nworkers;
+	p->ntasks = ntasks;
+	for(p->mask = 1; p->mask < ntasks; p->mask <<= 1)
+		;
+	p->q = calloc(nworkers, sizeof(Deque));
+	p->w = calloc(nworkers, sizeof(Worker));
+	if(p->q == NULL || p->w == NULL)
+		goto fail;
+	for(i = 0; i < nworkers; i++){
+		p->q[i].t = malloc(p->mask * sizeof(Task));
+		if(p->q[i].t == NULL)
+			goto fail;
+		pthread_mutex_init(&p->q[i].lock, NULL);
+	}
+	p->mask--;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->left = ntasks;
+	t.due = 0;
+	for(i = 0; i < ntasks; i++){
+		t.arg = tasks[i];
+		put(p, i % nworkers, t);
+	}
+	return p;
+fail:
+	if(p->q)
+		for(i = 0; i < nworkers; i++)
+			free(p->q[i].t);
+	free(p->q);
+	free(p->w);
+	free(p);
+	return NULL;
+}
+
+int
+pool_start(Pool *p, Slice fn)
+{
+	int i, err;
+
+	p->fn = fn;
+	for(i = 0; i < p->nworkers; i++){
+		p->w[i].p = p;
+		p->w[i].id = i;
+		err = pthread_create(&p->w[i].thread, NULL, worker, &p->w[i]);
+		if(err != 0){
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* wait up to ms for every task to finish; returns how many are left */
+int
+pool_wait(Pool *p, int ms)
+{
+	struct timespec ts;
+	int left;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000){
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&p->lock);
+	if(p->left > 0)
+		pthread_cond_timedwait(&p->done, &p->lock, &ts);
+	left = p->left;
+	pthread_mutex_unlock(&p->lock);
+	return left;
+}
+
+uint64_t
+pool_steals(Pool *p)
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&p->lock);
+	n = p->steals;
+	pthread_mutex_unlock(&p->lock);
+	return n;
+}
+
+/* once every task is finished */
+void
+pool_free(Pool *p)
+{
+	int i;
+
+	for(i = 0; i < p->nworkers; i++){
+		if(p->w[i].p)
+			pthread_join(p->w[i].thread, NULL);
+		pthread_mutex_destroy(&p->q[i].lock);
+		free(p->q[i].t);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->done);
+	free(p->q);
+	free(p->w);
+	free(p);
+}
@@ -0,0 +1,15 @@
+typedef struct Pool Pool;
+
+/*
+ * Run one time slice of task on worker w. Returns 0 once the task is
+ * finished, otherwise the pool_now() time before which it need not run
+ * again; anything already past runs it as soon as a worker is free.
+ */
+typedef uint64_t (*Slice)(void *task, int w);
+
+Pool *pool_new(int nworkers, int ntasks, void **tasks);
+int pool_start(Pool *p, Slice fn);
+int pool_wait(Pool *p, int ms);
+uint64_t pool_steals(Pool *p);
+void pool_free(Pool *p);
+uint64_t pool_now(void);
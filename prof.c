@@ -0,0 +1,240 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prof.h"
+
+/*
+ * Flat counts are kept for every bank and PC, 16 MB of mostly
+ * untouched zero pages. Calls are followed on a shadow stack: an
+ * instruction moving SP down by two and not on to the next byte, which
+ * a PUSH would, is a CALL, an RST or an interrupt, and SP going above
+ * a frame's return address pops the frame, whether by RET, POP or a
+ * reload of SP. Each distinct stack is a node of a call tree holding
+ * the cycles spent with exactly that stack, one folded line each.
+ */
+#define NBANK 16
+#define NNODE 65536
+#define NHASH (2 * NNODE)
+#define DEPTH 256
+#define ROOT  0xffffffff	/* at of the tree root */
+
+typedef struct Hit Hit;
+struct Hit{
+	uint64_t cycles;
+	uint64_t count;
+};
+
+typedef struct Node Node;
+struct Node{
+	uint32_t at;	/* entry point */
+	uint32_t parent;
+	uint64_t cycles;
+};
+
+typedef struct Frame Frame;
+struct Frame{
+	uint32_t node;
+	uint16_t sp;	/* at the return address */
+};
+
+typedef struct Line Line;
+struct Line{
+	uint32_t at;
+	uint64_t cycles;
+	uint64_t count;
+};
+
+struct Prof{
+	Hit *hit;
+	uint64_t in[256];
+	uint64_t out[256];
+	Node node[NNODE];
+	uint32_t nnode;
+	uint32_t hash[NHASH];	/* node index + 1, 0 when empty */
+	Frame stack[DEPTH];
+	int depth;
+	uint32_t cur;
+};
+
+Prof *
+prof_new(void)
+{
+	Prof *p;
+
+	p = calloc(1, sizeof(Prof));
+	if(p == NULL)
+		return NULL;
+	p->hit = calloc(NBANK << 16, sizeof(Hit));
+	if(p->hit == NULL){
+		free(p);
+		return NULL;
+	}
+	p->node[0].at = ROOT;
+	p->nnode = 1;
+	return p;
+}
+
+void
+prof_free(Prof *p)
+{
+	free(p->hit);
+	free(p);
+}
+
+/* the node for a call to at from parent; a full tree charges the caller */
+static uint32_t
+child(Prof *p, uint32_t parent, uint32_t at)
+{
+	uint32_t h, i;
+
+	h = (at * 2654435761u ^ parent * 40503u) & (NHASH - 1);
+	for(; (i = p->hash[h]) != 0; h = (h + 1) & (NHASH - 1))
+		if(p->node[i - 1].at == at && p->node[i - 1].parent == parent)
+			return i - 1;
+	if(p->nnode == NNODE)
+		return parent;
+	i = p->nnode++;
+	p->node[i].at = at;
+	p->node[i].parent = parent;
+	p->node[i].cycles = 0;
+	p->hash[h] = i + 1;
+	return i;
+}
+
+/* an instruction at at, with SP sp0, took cycles and left PC at to and SP at sp */
+void
+prof_insn(Prof *p, uint32_t at, uint16_t sp0, uint32_t to, uint16_t sp, unsigned cycles)
+{
+	Hit *h;
+
+	h = &p->hit[at];
+	h->cycles += cycles;
+	h->count++;
+	p->node[p->cur].cycles += cycles;
+	while(p->depth > 0 && (int16_t)(sp - p->stack[p->depth - 1].sp) > 0)
+		p->depth--;
+	if((uint16_t)(sp0 - sp) == 2 && (uint16_t)(to - at) != 1 && p->depth < DEPTH){
+		p->stack[p->depth].node = child(p, p->cur, to);
+		p->stack[p->depth].sp = sp;
+		p->depth++;
+	}
+	p->cur = p->depth > 0 ? p->stack[p->depth - 1].node : 0;
+}
+
+void
+prof_port(Prof *p, uint8_t port, int out)
+{
+	if(out)
+		p->out[port]++;
+	else
+		p->in[port]++;
+}
+
+static char *
+label(uint32_t at, char *buf, size_t len)
+{
+	if(at == ROOT)
+		snprintf(buf, len, "top");
+	else if(at >> 16 == 0xf)
+		snprintf(buf, len, "ROM:%04X", at & 0xffff);
+	else
+		snprintf(buf, len, "%X:%04X", at >> 16, at & 0xffff);
+	return buf;
+}
+
+static int
+bycycles(const void *a, const void *b)
+{
+	const Line *x, *y;
+
+	x = a;
+	y = b;
+	if(x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+	return x->at < y->at ? -1 : x->at > y->at;
+}
+
+/* the top hot spots by cycles, then cycles by bank and accesses by port */
+void
+prof_report(Prof *p, FILE *f, int top)
+{
+	uint64_t total, insns, bank[NBANK];
+	Line *l;
+	char buf[16];
+	int i, n;
+
+	total = insns = 0;
+	memset(bank, 0, sizeof(bank));
+	for(i = n = 0; i < NBANK << 16; i++){
+		if(p->hit[i].count == 0)
+			continue;
+		total += p->hit[i].cycles;
+		insns += p->hit[i].count;
+		bank[i >> 16] += p->hit[i].cycles;
+		n++;
+	}
+	fprintf(f, "%llu cycles, %llu instructions at %d addresses\n\n",
+		(unsigned long long)total, (unsigned long long)insns, n);
+	if(total == 0)
+		return;
+
+	l = malloc(n * sizeof(Line));
+	if(l != NULL){
+		for(i = n = 0; i < NBANK << 16; i++){
+			if(p->hit[i].count == 0)
+				continue;
+			l[n].at = i;
+			l[n].cycles = p->hit[i].cycles;
+			l[n].count = p->hit[i].count;
+			n++;
+		}
+		qsort(l, n, sizeof(Line), bycycles);
+		fprintf(f, "%-8s %14s %6s %14s\n", "at", "cycles", "%", "count");
+		for(i = 0; i < n && i < top; i++)
+			fprintf(f, "%-8s %14llu %6.2f %14llu\n", label(l[i].at, buf, sizeof(buf)),
+				(unsigned long long)l[i].cycles, 100.0 * l[i].cycles / total,
+				(unsigned long long)l[i].count);
+		free(l);
+	}
+
+	fprintf(f, "\n%-8s %14s %6s\n", "bank", "cycles", "%");
+	for(i = 0; i < NBANK; i++){
+		if(bank[i] == 0)
+			continue;
+		if(i == 0xf)
+			snprintf(buf, sizeof(buf), "ROM");
+		else
+			snprintf(buf, sizeof(buf), "%X", i);
+		fprintf(f, "%-8s %14llu %6.2f\n", buf, (unsigned long long)bank[i], 100.0 * bank[i] / total);
+	}
+
+	fprintf(f, "\n%-8s %14s %14s\n", "port", "in", "out");
+	for(i = 0; i < 256; i++)
+		if(p->in[i] || p->out[i])
+			fprintf(f, "%02X       %14llu %14llu\n", i,
+				(unsigned long long)p->in[i], (unsigned long long)p->out[i]);
+}
+
+/* one line per call stack, outermost frame first, as flamegraph.pl takes them */
+void
+prof_folded(Prof *p, FILE *f)
+{
+	uint32_t path[DEPTH + 1];
+	char buf[16];
+	uint32_t i, k;
+	int n;
+
+	for(i = 0; i < p->nnode; i++){
+		if(p->node[i].cycles == 0)
+			continue;
+		n = 0;
+		for(k = i; k != 0 && n < DEPTH; k = p->node[k].parent)
+			path[n++] = k;
+		fputs("top", f);
+		while(n > 0)
+			fprintf(f, ";%s", label(p->node[path[--n]].at, buf, sizeof(buf)));
+		fprintf(f, " %llu\n", (unsigned long long)p->node[i].cycles);
+	}
+}
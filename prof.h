@@ -0,0 +1,14 @@
+typedef struct Prof Prof;
+
+/*
+ * Addresses are a bank, 0xf for the ROM, above a 16-bit PC: the bank
+ * is the one mapped at the PC's slot when the instruction ran.
+ */
+#define PROF_AT(bank, pc) ((uint32_t)(bank) << 16 | (pc))
+
+Prof *prof_new(void);
+void prof_free(Prof *p);
+void prof_insn(Prof *p, uint32_t at, uint16_t sp0, uint32_t to, uint16_t sp, unsigned cycles);
+void prof_port(Prof *p, uint8_t port, int out);
+void prof_report(Prof *p, FILE *f, int top);
+void prof_folded(Prof *p, FILE *f);
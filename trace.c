@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <SDL2/SDL_atomic.h>
+
+#include "trace.h"
+
+/*
+ * Records go into a single-producer ring the emulation thread fills
+ * and a writer thread drains to the file. The producer publishes its
+ * head every PUBLISH records and at trace_sync(), so the ring costs an
+ * atomic store now and then rather than one per record. When the
+ * writer falls behind the producer waits for it: a trace with holes
+ * would be no use.
+ */
+#define NREC    65536	/* 1.5 MB */
+#define PUBLISH 256
+#define CHUNK   2048	/* records packed per write */
+
+struct Trace{
+	TraceRec rec[NREC];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	SDL_atomic_t done;
+	unsigned n;	/* producer's head */
+	unsigned limit;	/* head it may reach before looking at the tail again */
+	unsigned long long waits;
+	unsigned long long count;
+	gzFile gz;
+	int err;
+	pthread_t thread;
+};
+
+void
+trace_pack(TraceRec *r, uint8_t *p)
+{
+	int i;
+
+	for(i = 0; i < 8; i++)
+		p[i] = r->cyc >> 8 * i;
+	p[8] = r->addr;
+	p[9] = r->addr >> 8;
+	p[10] = r->sp;
+	p[11] = r->sp >> 8;
+	p[12] = r->banks;
+	p[13] = r->banks >> 8;
+	p[14] = r->kind;
+	p[15] = r->val;
+	memcpy(p + 16, r->r, 8);
+}
+
+void
+trace_unpack(uint8_t *p, TraceRec *r)
+{
+	int i;
+
+	r->cyc = 0;
+	for(i = 0; i < 8; i++)
+		r->cyc |= (uint64_t)p[i] << 8 * i;
+	r->addr = p[8] | p[9] << 8;
+	r->sp = p[10] | p[11] << 8;
+	r->banks = p[12] | p[13] << 8;
+	r->kind = p[14];
+	r->val = p[15];
+	memcpy(r->r, p + 16, 8);
+}
+
+static void *
+writer(void *arg)
+{
+	static const struct timespec ms = {0, 1000000};
+	uint8_t buf[CHUNK * TRACE_LEN];
+	Trace *t;
+	unsigned head, tail, k;
+	int done;
+
+	t = arg;
+	tail = SDL_AtomicGet(&t->tail);
+	for(;;){
+		done = SDL_AtomicGet(&t->done);
+		head = SDL_AtomicGet(&t->head);
+		if(head == tail){
+			if(done)
+				break;
+			nanosleep(&ms, NULL);
+			continue;
+		}
+		for(k = 0; tail != head && k < CHUNK; k++, tail++)
+			trace_pack(&t->rec[tail % NREC], buf + k * TRACE_LEN);
+		if(!t->err && gzwrite(t->gz, buf, k * TRACE_LEN) != (int)(k * TRACE_LEN))
+			t->err = 1;
+		SDL_AtomicSet(&t->tail, tail);
+	}
+	return NULL;
+}
+
+/* a .gz name is deflated at the fastest level */
+Trace *
+trace_open(char *path)
+{
+	Trace *t;
+	size_t len;
+	int e;
+
+	t = calloc(1, sizeof(Trace));
+	if(t == NULL)
+		return NULL;
+	len = strlen(path);
+	t->gz = gzopen(path, len > 3 && strcmp(path + len - 3, ".gz") == 0 ? "wb1" : "wbT");
+	if(t->gz == NULL){
+		free(t);
+		return NULL;
+	}
+	if(gzwrite(t->gz, TRACE_MAGIC, 8) != 8){
+		gzclose(t->gz);
+		free(t);
+		errno = EIO;
+		return NULL;
+	}
+	t->limit = NREC;
+	e = pthread_create(&t->thread, NULL, writer, t);
+	if(e != 0){
+		gzclose(t->gz);
+		free(t);
+		errno = e;
+		return NULL;
+	}
+	return t;
+}
+
+void
+trace_put(Trace *t, TraceRec *r)
+{
+	if(t->n == t->limit){
+		SDL_AtomicSet(&t->head, t->n);
+		while((t->limit = SDL_AtomicGet(&t->tail) + NREC) == t->n){
+			t->waits++;
+			sched_yield();
+		}
+	}
+	t->rec[t->n % NREC] = *r;
+	t->n++;
+	t->count++;
+	if(t->n % PUBLISH == 0)
+		SDL_AtomicSet(&t->head, t->n);
+}
+
+void
+trace_sync(Trace *t)
+{
+	SDL_AtomicSet(&t->head, t->n);
+}
+
+/* drain and close; a report line in buf */
+int
+trace_close(Trace *t, char *buf, size_t len)
+{
+	int ret;
+
+	trace_sync(t);
+	SDL_AtomicSet(&t->done, 1);
+	pthread_join(t->thread, NULL);
+	ret = gzclose(t->gz) != Z_OK || t->err ? -1 : 0;
+	snprintf(buf, len, "trace: %llu records, %llu waits for the writer",
+		t->count, t->waits);
+	free(t);
+	return ret;
+}
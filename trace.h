@@ -0,0 +1,36 @@
+typedef struct Trace Trace;
+typedef struct TraceRec TraceRec;
+
+/*
+ * A trace file is TRACE_MAGIC followed by TRACE_LEN-byte records,
+ * little-endian, deflated as a whole when the name ends in .gz. An
+ * instruction record comes before the instruction runs and holds the
+ * registers it starts with; its writes and port accesses follow it.
+ */
+#define TRACE_MAGIC "P80TRC1\n"
+#define TRACE_LEN   24
+
+enum{
+	TR_INSN,
+	TR_IRQ,	/* interrupt taken before the next instruction */
+	TR_WRITE,
+	TR_IN,
+	TR_OUT,
+};
+
+struct TraceRec{
+	uint64_t cyc;
+	uint16_t addr;	/* PC, or the address or port accessed */
+	uint16_t sp;
+	uint16_t banks;	/* bank mapped at each slot, a nibble each, 0xf the ROM */
+	uint8_t kind;
+	uint8_t val;	/* opcode, or the value */
+	uint8_t r[8];	/* B C D E H L F A */
+};
+
+Trace *trace_open(char *path);
+void trace_put(Trace *t, TraceRec *r);
+void trace_sync(Trace *t);
+int trace_close(Trace *t, char *buf, size_t len);
+void trace_pack(TraceRec *r, uint8_t *p);
+void trace_unpack(uint8_t *p, TraceRec *r);